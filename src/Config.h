@@ -7,6 +7,11 @@
 //
 #define _d_release 0
 
+// Set by Optimizer.cpp, which builds the offline asset optimizer from Main.cpp without its main().
+#ifndef _d_optimizer
+  #define _d_optimizer 0
+#endif
+
 //
 #define _d_enable_log_info 1
 #define _d_enable_log_warn 1
@@ -15,12 +20,130 @@
 //
 #define _d_log_buffer_length 1024
 
+//
+#define _d_sprite_batch_capacity 256
+#define _d_enable_batch_stats 1
+
+//
+#define _d_atlas_page_size 1024
+#define _d_atlas_padding 1
+#define _d_atlas_max_sprites 32
+
+// Textures are stored in the smallest format that draws the same: alpha for white masks, luminance
+// for greys, RGB when opaque. Lossy stores opaque images as RGB565, or S3TC where the driver has it.
+#define _d_enable_compact_textures 1
+#define _d_compact_textures_lossy 0
+
+// Frames since the back buffer was last drawn, 0 when unknown (always a full redraw). SDL 1.2 can
+// not query it, set 1 for copy swaps or 2 for a known flip chain.
+#define _d_damage_buffer_age 0
+#define _d_damage_max_rects 8
+#define _d_damage_max_items 8
+#define _d_damage_max_age 4
+#define _d_enable_damage_stats 1
+
+// Sprites are drawn as at most this many bands over their non-transparent texels. A band is only
+// split off when it saves more than this many texels of fill, the cost of a quad.
+#define _d_texture_mesh_max_parts 4
+#define _d_texture_mesh_part_cost 2048
+#define _d_enable_overdraw_stats 1
+
+// Pages over the budget, least recently drawn first, are released and reloaded when next drawn.
+// 0 keeps everything resident, --texture-budget=KB overrides it.
+#define _d_texture_budget_kb 0
+#define _d_texture_manager_max_textures 32
+#define _d_enable_texture_stats 1
+
+//
+#define _d_enable_scheduler_stats 1
+
+// Phase timings and GL timer queries, reported on exit and on SIGUSR1 (SIGBREAK on Windows).
+#define _d_enable_profiler 1
+#define _d_profiler_buckets 256
+#define _d_profiler_gpu_queries 4
+
+// CpuRenderer kernels. AVX2 intrinsics need GCC or MSVC 2013 and later.
+#define _d_enable_sse2 1
+#define _d_enable_avx2 1
+
+#define _d_compositor_sse2 _d_enable_sse2
+#if _d_cc_gnu || (_d_cc_msc && _MSC_VER >= 1800)
+  #define _d_compositor_avx2 _d_enable_avx2
+#else
+  #define _d_compositor_avx2 0
+#endif
+
+#define _d_cpu_renderer_max_texture_size 8192
+
+// 64*64 tiles keep a tile's pixels, 16KB, in L1 while its draws are replayed. Threads 0 uses every core.
+#define _d_cpu_renderer_tile_size 64
+#define _d_cpu_renderer_max_commands 512
+#define _d_cpu_renderer_threads 0
+#define _d_bench_raster_frames 60
+
+// --headless=N: virtual milliseconds per frame, --step overrides it.
+#define _d_headless_step 16
+#define _d_headless_max_dumps 16
+#define _d_headless_dump_prefix "frame-"
+
 //
 #define _d_app_default_screen_width 800
 #define _d_app_default_screen_height 600
 #define _d_app_default_sound_volume 64
 #define _d_app_window_caption "Night City Blues"
-#if _d_os_win
+#define _d_app_max_texture_pages 16
+#define _d_app_stats_interval 5000
+#define _d_app_max_fps 60
+
+// The airplane moves in fixed steps, drawn interpolated between the last two. Steps a frame may
+// catch up on before the rest of a stall is dropped.
+#define _d_app_sim_hz 120
+#define _d_app_sim_max_steps 8
+#define _d_app_default_renderer_cpu 0
+
+// Positions below are in this space, letterboxed into windows of another size (--size=WxH). Scale modes,
+// see App::ScaleMode: 0 native, 1 target (--scale=target), 2 assets (--scale=assets).
+#define _d_app_view_width 800
+#define _d_app_view_height 600
+#define _d_app_default_scale_mode 0
+#define _d_bench_scale_frames 120
+
+// Without Windows resources assets come from a pack, linked in with .incbin or mapped from disk.
+// --make-pack=<dir> builds one from the files in dir.
+#define _d_enable_asset_pack (!_d_os_win)
+#define _d_asset_pack_embedded 0
+#define _d_asset_pack_file "NightCityBlues.pack"
+#define _d_asset_pack_alignment 64
+#define _d_asset_pack_name_length 32
+
+// NightCityBlues-Optimizer <pack> out/*.png out/blues.mp3 out/timeline.txt packs trimmed, atlased pages described by this
+// entry. A pack holding it is used instead of the PNGs; on Windows it is looked for next to the binary.
+#define _d_asset_manifest_name "assets.manifest"
+
+// Decoded assets, so a restart skips PNG decoding. Bump the format tag when decoding changes.
+#define _d_enable_image_cache 1
+#define _d_image_cache_dir "cache"
+#define _d_image_cache_format "RGBA8-v2"
+#define _d_image_cache_alignment 64
+#define _d_image_cache_max_files 16
+
+// Atlas pages are uploaded over several frames once the loop runs, at most this many bytes per frame.
+#define _d_enable_texture_streaming 1
+#define _d_texture_streaming_budget (256 * 1024)
+
+#if _d_enable_asset_pack
+  #define _d_app_res_np "np.png"
+
+  #define _d_app_res_nc          "nc.png"
+  #define _d_app_res_nc_lights_1 "nc-lights1.png"
+
+  #define _d_app_res_airplane              "airplane.png"
+  #define _d_app_res_airplane_lights_red   "airplane-lights-red.png"
+  #define _d_app_res_airplane_lights_green "airplane-lights-green.png"
+  #define _d_app_res_airplane_lights_white "airplane-lights-white.png"
+
+  #define _d_app_res_blues "blues.mp3"
+#elif _d_os_win
   // Refer to resource.h
   #define _d_app_res_np IDB_PNG7
 
@@ -35,6 +158,17 @@
   #define _d_app_res_blues IDR_FOO1
 #endif
 
+// Cues for the entities, see Timeline. Looked for in the pack, then next to the binary. Without
+// it the "now playing" badge fades in at appear, holds for sleep and fades out, as set below.
+#define _d_timeline_name "timeline.txt"
+#define _d_timeline_name_length 16
+#define _d_bench_timeline_tracks 10000
+#define _d_bench_timeline_keys 32
+
+// --bench-fades, see FadeBank.
+#define _d_bench_fade_bank_count 4096
+#define _d_bench_fade_bank_frames 1000
+
 //
 #define _d_app_np_x 225
 #define _d_app_np_y 491
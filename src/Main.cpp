@@ -11,9 +11,33 @@
 #if _d_os_win
   #include <windows.h>
   #include "resource.h"
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <time.h>
+  #include <unistd.h>
 #endif
 
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <png.h>
+
+#if _d_compositor_sse2
+  #include <emmintrin.h>
+#endif
+
+#if _d_compositor_avx2
+  #include <immintrin.h>
+#endif
+
+#if _d_cc_msc
+  #include <intrin.h>
+#endif
 
 //
 //
@@ -179,6 +203,22 @@ class Log
     }
 #endif
 
+//
+//
+//
+inline uint32 NextPowerOfTwo(uint32 n)
+{
+  --n;
+  n |= n>>1;
+  n |= n>>2;
+  n |= n>>4;
+  n |= n>>8;
+  n |= n>>16;
+  ++n;
+
+  return n;
+}
+
 //
 //
 //
@@ -322,6 +362,14 @@ template<typename T> class Line
       this->direction.Set(copy.GetDirection());
     }
 
+    Line<T>& Set(const Line<T> &line)
+    {
+      origin.Set(line.GetOrigin());
+      direction.Set(line.GetDirection());
+
+      return *this;
+    }
+
     Vector<T> GetOrigin() const
     {
       return origin;
@@ -361,7 +409,7 @@ template<typename T> class Line
       return *this;
     }
 
-    Vector<T> GetAbsDirection()
+    Vector<T> GetAbsDirection() const
     {
       Vector<T> v(origin);
       v.Add(direction);
@@ -375,432 +423,7127 @@ typedef Line<GLdouble> Line2d;
 //
 //
 //
-class TimeMgr
+class Rect
 {
   public:
-    typedef uint32 Time;
+    GLint x;
+    GLint y;
+    GLint width;
+    GLint height;
 
-    static Time GetTicks()
+    Rect()
+      : x(0), y(0), width(0), height(0)
     {
-      // "Initialization". Taking in account application loading time,
-      // as SDL_GetTicks() returns time since SDL init.
-      static Time t = SDL_GetTicks();
+      ;
+    }
 
-      return SDL_GetTicks() - t;
+    Rect(GLint x, GLint y, GLint width, GLint height)
+      : x(x), y(y), width(width), height(height)
+    {
+      ;
     }
-};
 
-//
-//
-//
-typedef GLuint GlTexture;
+    // Smallest pixel-aligned rectangle covering the given one.
+    static Rect Cover(GLdouble x, GLdouble y, GLdouble width, GLdouble height)
+    {
+      const GLint left = (GLint)::floor(x);
+      const GLint top = (GLint)::floor(y);
 
-class Texture
-{
-  public:
-    const GlTexture TEXTURE;
+      return Rect(left, top, (GLint)::ceil(x + width) - left, (GLint)::ceil(y + height) - top);
+    }
 
-    const GLint WIDTH;
-    const GLint HEIGHT;
+    bool IsEmpty() const
+    {
+      return width <= 0 || height <= 0;
+    }
 
-    const GLdouble TEXEL_WIDTH;
-    const GLdouble TEXEL_HEIGHT;
+    GLint GetArea() const
+    {
+      return IsEmpty() ? 0 : width * height;
+    }
 
-    Texture(GlTexture texture, GLint width, GLint height, GLdouble texelWidth, GLdouble texelHeight)
-      : TEXTURE(texture), WIDTH(width), HEIGHT(height), TEXEL_WIDTH(texelWidth), TEXEL_HEIGHT(texelHeight)
+    bool operator ==(const Rect &r) const
     {
-      ;
+      return x == r.x && y == r.y && width == r.width && height == r.height;
     }
 
-    ~Texture()
+    bool operator !=(const Rect &r) const
     {
-      glDeleteTextures(1, &TEXTURE);
+      return !(*this == r);
     }
 
-    operator GlTexture()
+    // Touching rectangles count as intersecting, merging them costs nothing.
+    bool Touches(const Rect &r) const
     {
-      return TEXTURE;
+      return x <= r.x + r.width && r.x <= x + width && y <= r.y + r.height && r.y <= y + height;
     }
 
-    void DrawQuad(GLdouble x, GLdouble y)
+    Rect& Union(const Rect &r)
     {
-      glBindTexture(GL_TEXTURE_2D, TEXTURE);
-      glBegin(GL_QUADS);
-        glTexCoord2d(0, 0);
-        glVertex3d(x, y, 0);
- 
-        glTexCoord2d(TEXEL_WIDTH, 0);
-        glVertex3d(WIDTH + x, y, 0);
- 
-        glTexCoord2d(TEXEL_WIDTH, TEXEL_HEIGHT);
-        glVertex3d(WIDTH + x, HEIGHT + y, 0);
- 
-        glTexCoord2d(0, TEXEL_HEIGHT);
-        glVertex3d(x, HEIGHT + y, 0);
-      glEnd();
+      if(r.IsEmpty())
+        return *this;
+      if(IsEmpty())
+        return *this = r;
+
+      const GLint right = x + width > r.x + r.width ? x + width : r.x + r.width;
+      const GLint bottom = y + height > r.y + r.height ? y + height : r.y + r.height;
+
+      x = x < r.x ? x : r.x;
+      y = y < r.y ? y : r.y;
+      width = right - x;
+      height = bottom - y;
+
+      return *this;
+    }
+
+    Rect& Intersect(const Rect &r)
+    {
+      const GLint right = x + width < r.x + r.width ? x + width : r.x + r.width;
+      const GLint bottom = y + height < r.y + r.height ? y + height : r.y + r.height;
+
+      x = x > r.x ? x : r.x;
+      y = y > r.y ? y : r.y;
+      width = right - x;
+      height = bottom - y;
+
+      if(IsEmpty())
+        width = height = 0;
+
+      return *this;
     }
 };
 
 //
 //
 //
-class Fade
+// Where TimeMgr reads time from. See TimeMgr::SetClock().
+class Clock
 {
   public:
-    const uint32 FADE_MILLIS;
-    const uint32 SLEEP_MILLIS;
-
-    Fade()
-      : FADE_MILLIS(0), SLEEP_MILLIS(0)
+    virtual ~Clock()
     {
       ;
     }
 
-    Fade(uint32 fadeMillis, uint32 sleepMillis = 0, bool fadeIn = true)
-      : FADE_MILLIS(fadeMillis), SLEEP_MILLIS(sleepMillis),
-        fadeIn(true), fade(fadeIn ? 0 : 1), sleep(0)
+    // Monotonic, from any origin.
+    virtual uint64 GetNanos() const = 0;
+};
+
+// The OS monotonic counter: clock_gettime(CLOCK_MONOTONIC), or the performance counter on Windows.
+class MonotonicClock : public Clock
+{
+  public:
+    uint64 GetNanos() const
     {
-      ;
+      return Now();
     }
 
-    //Fade(uint32 fadeMillis, uint32 sleepMillis = 0, bool fadeIn = true, float64 fade = 0)
-    //  : FADE_MILLIS(fadeMillis), SLEEP_MILLIS(sleepMillis),
-    //    fadeIn(true), fade(fadeIn ? 0 : 1), sleep(0)
-    //{
-    //  ;
-    //}
-
-    float64 Calc(uint32 prevTime, uint32 currentTime)
+    static uint64 Now()
     {
-      const uint32 elapsedTime = currentTime - prevTime;
-
-      sleep += elapsedTime;
-      if(sleep >= SLEEP_MILLIS)
-      {
-        float64 fadeTick = (double)elapsedTime / (double)FADE_MILLIS;
-        if(fadeTick > FADE_MILLIS)
+      #if _d_os_win
+        static LONGLONG frequency = 0;
+        if(!frequency)
         {
-          // TODO: !
+          LARGE_INTEGER f;
+          QueryPerformanceFrequency(&f);
+          frequency = f.QuadPart;
         }
 
-        fade += fadeIn ? fadeTick : -fadeTick;
-        if(fade >= 1)
-        {
-          fadeIn = false;
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
 
-          if(fade > 1)
-            fade += 1 - fade;
-        }
-        elif(fade <= 0)
-        {
-          fadeIn = true;
-          sleep = 0;
+        return (uint64)(counter.QuadPart / frequency * 1000000000 + counter.QuadPart % frequency * 1000000000 / frequency);
+      #else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
 
-          if(fade < 0)
-            fade = -fade;
-        }
+        return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+      #endif
+    }
+};
 
-        if(fade < 0 || fade > 1)
-          _d_log_fatal("Fade: " << fade);
+// Only moves when told to. Headless runs, benchmarks.
+class ManualClock : public Clock
+{
+  public:
+    ManualClock()
+      : nanos(0)
+    {
+      ;
+    }
 
-        return fade;
-      }
+    uint64 GetNanos() const
+    {
+      return nanos;
+    }
+
+    void Advance(uint64 step)
+    {
+      nanos += step;
     }
 
   private:
-    bool fadeIn;
-    float64 fade;
-    uint32 sleep;
+    uint64 nanos;
 };
 
 //
 //
 //
-class NightCityEntity
+class TimeMgr
 {
   public:
-    Vector2d pos;
-    Texture &texture;
-    Fade fade;
+    // Milliseconds, what the scene's timings are given in. 64 bits never wrap.
+    typedef uint64 Time;
 
-    NightCityEntity(const Vector2d &position, Texture &texture)
-      : pos(position), texture(texture)
+    typedef uint64 Nanos;
+
+    // Since the first call after the clock was set. Taking in account application loading time,
+    // the origin is not process start.
+    static Nanos GetNanos()
     {
-      ;
+      State &state = GetState();
+      const Nanos now = state.clock->GetNanos();
+
+      if(!state.started)
+      {
+        state.origin = now;
+        state.started = true;
+      }
+
+      return now - state.origin;
     }
 
-    NightCityEntity(const Vector2d &position, Texture &texture, Fade &fade)
-      : pos(position), texture(texture), fade(fade)
+    static Time GetTicks()
     {
-      ;
+      return ToMillis(GetNanos());
+    }
+
+    static Time ToMillis(Nanos nanos)
+    {
+      return nanos / 1000000;
+    }
+
+    static Nanos ToNanos(Time millis)
+    {
+      return millis * 1000000;
+    }
+
+    // Monotonic wall clock for profiling, unaffected by SetClock().
+    static uint64 GetPerfMicros()
+    {
+      return MonotonicClock::Now() / 1000;
+    }
+
+    // Null goes back to the MonotonicClock. Time starts at 0 again. The clock must outlive its use.
+    static void SetClock(Clock *clock)
+    {
+      State &state = GetState();
+      state.clock = clock ? clock : state.monotonic;
+      state.started = false;
+    }
+
+  private:
+    struct State
+    {
+      Clock *monotonic;
+      Clock *clock;
+
+      Nanos origin;
+      bool started;
+    };
+
+    static State& GetState()
+    {
+      static MonotonicClock monotonic;
+      static State state = {&monotonic, &monotonic, 0, false};
+
+      return state;
     }
 };
 
 //
 //
 //
-class AirplaneEntity
+// GL_ARB_timer_query, newer than the bundled glext.h.
+#ifndef GL_ARB_timer_query
+  #define GL_TIME_ELAPSED 0x88BF
+
+  typedef void (APIENTRYP PFNGLGETQUERYOBJECTUI64VPROC)(GLuint id, GLenum pname, uint64 *params);
+#endif
+
+class GlCaps
 {
   public:
-    Line2d path;
+    GLint maxTextureSize;
+
+    bool npot;
+    bool rectangle;
+    bool fragmentProgram;
+    bool timerQuery;
+    bool pixelBuffer;
+    bool s3tc;
+    bool framebufferObject;
+
+    PFNGLGENPROGRAMSARBPROC glGenProgramsARB;
+    PFNGLDELETEPROGRAMSARBPROC glDeleteProgramsARB;
+    PFNGLBINDPROGRAMARBPROC glBindProgramARB;
+    PFNGLPROGRAMSTRINGARBPROC glProgramStringARB;
+
+    PFNGLGENQUERIESPROC glGenQueries;
+    PFNGLDELETEQUERIESPROC glDeleteQueries;
+    PFNGLBEGINQUERYPROC glBeginQuery;
+    PFNGLENDQUERYPROC glEndQuery;
+    PFNGLGETQUERYOBJECTIVPROC glGetQueryObjectiv;
+    PFNGLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v;
+
+    PFNGLGENBUFFERSARBPROC glGenBuffersARB;
+    PFNGLDELETEBUFFERSARBPROC glDeleteBuffersARB;
+    PFNGLBINDBUFFERARBPROC glBindBufferARB;
+    PFNGLBUFFERDATAARBPROC glBufferDataARB;
+    PFNGLMAPBUFFERARBPROC glMapBufferARB;
+    PFNGLUNMAPBUFFERARBPROC glUnmapBufferARB;
+
+    PFNGLGENFRAMEBUFFERSEXTPROC glGenFramebuffersEXT;
+    PFNGLDELETEFRAMEBUFFERSEXTPROC glDeleteFramebuffersEXT;
+    PFNGLBINDFRAMEBUFFEREXTPROC glBindFramebufferEXT;
+    PFNGLFRAMEBUFFERTEXTURE2DEXTPROC glFramebufferTexture2DEXT;
+    PFNGLCHECKFRAMEBUFFERSTATUSEXTPROC glCheckFramebufferStatusEXT;
+
+    // Requires a current GL context.
+    GlCaps()
+    {
+      glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
 
-    Texture &airplaneTexture;
+      const char *version = (const char *)glGetString(GL_VERSION);
+
+      // Non-power-of-two textures are core since 2.0.
+      npot = (version && version[0] >= '2' && version[0] <= '9')
+        || HasExtension("GL_ARB_texture_non_power_of_two");
+
+      rectangle = HasExtension("GL_ARB_texture_rectangle")
+        || HasExtension("GL_EXT_texture_rectangle")
+        || HasExtension("GL_NV_texture_rectangle");
+
+      glGenProgramsARB = (PFNGLGENPROGRAMSARBPROC)SDL_GL_GetProcAddress("glGenProgramsARB");
+      glDeleteProgramsARB = (PFNGLDELETEPROGRAMSARBPROC)SDL_GL_GetProcAddress("glDeleteProgramsARB");
+      glBindProgramARB = (PFNGLBINDPROGRAMARBPROC)SDL_GL_GetProcAddress("glBindProgramARB");
+      glProgramStringARB = (PFNGLPROGRAMSTRINGARBPROC)SDL_GL_GetProcAddress("glProgramStringARB");
+
+      fragmentProgram = HasExtension("GL_ARB_fragment_program")
+        && glGenProgramsARB && glDeleteProgramsARB && glBindProgramARB && glProgramStringARB;
+
+      glGenQueries = (PFNGLGENQUERIESPROC)SDL_GL_GetProcAddress("glGenQueries");
+      glDeleteQueries = (PFNGLDELETEQUERIESPROC)SDL_GL_GetProcAddress("glDeleteQueries");
+      glBeginQuery = (PFNGLBEGINQUERYPROC)SDL_GL_GetProcAddress("glBeginQuery");
+      glEndQuery = (PFNGLENDQUERYPROC)SDL_GL_GetProcAddress("glEndQuery");
+      glGetQueryObjectiv = (PFNGLGETQUERYOBJECTIVPROC)SDL_GL_GetProcAddress("glGetQueryObjectiv");
+      glGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC)SDL_GL_GetProcAddress("glGetQueryObjectui64v");
+
+      timerQuery = HasExtension("GL_ARB_timer_query")
+        && glGenQueries && glDeleteQueries && glBeginQuery && glEndQuery && glGetQueryObjectiv && glGetQueryObjectui64v;
+
+      glGenBuffersARB = (PFNGLGENBUFFERSARBPROC)SDL_GL_GetProcAddress("glGenBuffersARB");
+      glDeleteBuffersARB = (PFNGLDELETEBUFFERSARBPROC)SDL_GL_GetProcAddress("glDeleteBuffersARB");
+      glBindBufferARB = (PFNGLBINDBUFFERARBPROC)SDL_GL_GetProcAddress("glBindBufferARB");
+      glBufferDataARB = (PFNGLBUFFERDATAARBPROC)SDL_GL_GetProcAddress("glBufferDataARB");
+      glMapBufferARB = (PFNGLMAPBUFFERARBPROC)SDL_GL_GetProcAddress("glMapBufferARB");
+      glUnmapBufferARB = (PFNGLUNMAPBUFFERARBPROC)SDL_GL_GetProcAddress("glUnmapBufferARB");
+
+      pixelBuffer = HasExtension("GL_ARB_pixel_buffer_object")
+        && glGenBuffersARB && glDeleteBuffersARB && glBindBufferARB && glBufferDataARB && glMapBufferARB && glUnmapBufferARB;
+
+      s3tc = HasExtension("GL_EXT_texture_compression_s3tc");
+
+      glGenFramebuffersEXT = (PFNGLGENFRAMEBUFFERSEXTPROC)SDL_GL_GetProcAddress("glGenFramebuffersEXT");
+      glDeleteFramebuffersEXT = (PFNGLDELETEFRAMEBUFFERSEXTPROC)SDL_GL_GetProcAddress("glDeleteFramebuffersEXT");
+      glBindFramebufferEXT = (PFNGLBINDFRAMEBUFFEREXTPROC)SDL_GL_GetProcAddress("glBindFramebufferEXT");
+      glFramebufferTexture2DEXT = (PFNGLFRAMEBUFFERTEXTURE2DEXTPROC)SDL_GL_GetProcAddress("glFramebufferTexture2DEXT");
+      glCheckFramebufferStatusEXT = (PFNGLCHECKFRAMEBUFFERSTATUSEXTPROC)SDL_GL_GetProcAddress("glCheckFramebufferStatusEXT");
+
+      framebufferObject = HasExtension("GL_EXT_framebuffer_object")
+        && glGenFramebuffersEXT && glDeleteFramebuffersEXT && glBindFramebufferEXT && glFramebufferTexture2DEXT
+        && glCheckFramebufferStatusEXT;
+
+      _d_log_info("GL: " << (version ? version : "?")
+        << ", npot: " << npot << ", rectangle: " << rectangle
+        << ", fragment program: " << fragmentProgram << ", timer query: " << timerQuery
+        << ", pixel buffer: " << pixelBuffer << ", s3tc: " << s3tc << ", framebuffer object: " << framebufferObject
+        << ", max texture size: " << maxTextureSize);
+    }
 
-    Texture &lightsRedTexture;
-    Texture &lightsGreenTexture;
-    Texture &lightsWhiteTexture;
+    static bool HasExtension(const char *name)
+    {
+      const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+      if(!extensions)
+        return false;
 
-    Fade fade;
+      const size_t length = strlen(name);
 
-    TimeMgr::Time time;
+      // Whole tokens only, "GL_EXT_foo" must not match "GL_EXT_foo_bar".
+      for(const char *p = strstr(extensions, name); p; p = strstr(p + length, name))
+        if((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+          return true;
 
-    AirplaneEntity(const Line2d &path, Texture &airplaneTexture,
-      Texture &lightsRedTexture, Texture &lightsGreenTexture, Texture &lightsWhiteTexture,
-      Fade &fade)
-      : path(path), airplaneTexture(airplaneTexture),
-        lightsRedTexture(lightsRedTexture), lightsGreenTexture(lightsGreenTexture), lightsWhiteTexture(lightsWhiteTexture),
-        fade(fade),
-        time(0)
+      return false;
+    }
+
+    // Rectangle textures are used only when plain GL_TEXTURE_2D can not be NPOT.
+    GLenum GetTextureTarget() const
     {
-      ;
+      return !npot && rectangle ? GL_TEXTURE_RECTANGLE_ARB : GL_TEXTURE_2D;
+    }
+
+    GLint GetTextureSize(GLint n) const
+    {
+      if(npot || rectangle)
+        return n;
+
+      return NextPowerOfTwo(n);
+    }
+
+    static uint32 GetPaddedBytes(GLint width, GLint height, GLint bytesPerTexel)
+    {
+      return (NextPowerOfTwo(width) * NextPowerOfTwo(height) - width * height) * bytesPerTexel;
     }
 };
 
 //
 //
 //
-class App
+class FragmentProgram
 {
   public:
-    const uint32 SCREEN_WIDTH;
-    const uint32 SCREEN_HEIGHT;
-    const uint32 SOUND_VOLUME;
-    const char *const WINDOW_CAPTION;
+    const GlCaps &caps;
 
-    App(uint32 screenWidth, uint32 screenHeight, uint32 soundVolume, char *windowCaption)
-      : SCREEN_WIDTH(screenWidth), SCREEN_HEIGHT(screenHeight), SOUND_VOLUME(soundVolume), WINDOW_CAPTION(windowCaption)
+    FragmentProgram(const GlCaps &caps, const char *source)
+      : caps(caps), program(0)
     {
-      screen = null;
+      while(glGetError() != GL_NO_ERROR)
+        ;
 
-      nowPlayingTexture = null;
-      
-      nightCityTexture = null;
-      nightCityLights1Texture = null;
+      caps.glGenProgramsARB(1, &program);
+      caps.glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, program);
+      caps.glProgramStringARB(GL_FRAGMENT_PROGRAM_ARB, GL_PROGRAM_FORMAT_ASCII_ARB, (GLsizei)strlen(source), source);
 
-      airplaneTexture = null;
-      airplaneLightsRedTexture = null;
-      airplaneLightsGreenTexture = null;
-      airplaneLightsWhiteTexture = null;
+      if(glGetError() != GL_NO_ERROR)
+      {
+        GLint position;
+        glGetIntegerv(GL_PROGRAM_ERROR_POSITION_ARB, &position);
 
-      nowPlaying = null;
-      
-      nightCity = null;
-      nightCityLights1 = null;
+        _d_log_err("FragmentProgram: at " << position << ": " << (const char *)glGetString(GL_PROGRAM_ERROR_STRING_ARB));
 
-      airplane = null;
+        caps.glDeleteProgramsARB(1, &program);
+        program = 0;
+      }
 
-      blues = null;
+      caps.glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, 0);
     }
 
-    void Init()
+    ~FragmentProgram()
     {
-      //
-      if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
-        _d_log_fatal("Failed to initialize SDL: " << SDL_GetError());
-
-      //
-      atexit(SDL_Quit);
+      if(program)
+        caps.glDeleteProgramsARB(1, &program);
+    }
 
-      //
-      SDL_WM_SetCaption(WINDOW_CAPTION, WINDOW_CAPTION);
+    bool IsValid() const
+    {
+      return program != 0;
+    }
 
-      //
-      if(Mix_OpenAudio(22050, AUDIO_S16SYS, 2, 4096) < 0)
-        _d_log_fatal("Failed to initialize audio: " << SDL_GetError());
+    void Enable() const
+    {
+      glEnable(GL_FRAGMENT_PROGRAM_ARB);
+      caps.glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, program);
+    }
 
-      //
-      SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
-      screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_OPENGL/*SDL_DOUBLEBUF | SDL_HWPALETTE | SDL_HWSURFACE*/);
-      if(!screen)
-        _d_log_fatal("Failed to initialize video: " << SDL_GetError());
+    void Disable() const
+    {
+      caps.glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, 0);
+      glDisable(GL_FRAGMENT_PROGRAM_ARB);
+    }
 
-      //
-      glDisable(GL_DEPTH_TEST);
-      glEnable(GL_TEXTURE_2D);
-      glEnable(GL_BLEND);
-      glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
- 
-      glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
- 
-      glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
- 
-      glClear(GL_COLOR_BUFFER_BIT);
- 
-      glMatrixMode(GL_PROJECTION);
-      glLoadIdentity();
- 
-      glOrtho(0.0f, SCREEN_WIDTH, SCREEN_HEIGHT, 0.0f, -1.0f, 1.0f);
- 
-      glMatrixMode(GL_MODELVIEW);
-      glLoadIdentity();
+  private:
+    GLuint program;
+};
 
-      //
-      SDL_RWops *rw = LoadResource(_d_app_res_blues);
-      if(!rw)
-        _d_log_fatal(_d_file_line << ": " << SDL_GetError());
-      //blues = Mix_LoadMUS("blues.mp3");
-      blues = Mix_LoadMUS_RW(rw);
-      if(!blues)
-        _d_log_fatal(_d_file_line << ": " << SDL_GetError());
-      //SDL_FreeRW(rw); // Commented out. Required by streamer.
+//
+//
+//
+typedef GLuint GlTexture;
 
-      //
-      #define _d_load_img(__id, __dest) \
-        { \
-          SDL_RWops *rw = LoadResource(__id); \
-          if(!rw) \
-            _d_log_fatal("!rw: " << ": " << SDL_GetError()); \
-          \
-          SDL_Surface *tmp = IMG_Load_RW(rw, 0); \
-          if(!tmp) \
-            _d_log_fatal("!tmp: " << ": " << SDL_GetError()); \
-          \
-          __dest = MakeTexture(tmp); \
-          if(!__dest) \
-            _d_log_fatal("!__dest"); \
-          SDL_FreeSurface(tmp); \
-          SDL_FreeRW(rw); \
-        }
+class SpriteBatch
+{
+  public:
+    const uint32 CAPACITY;
 
-      _d_load_img(_d_app_res_np, nowPlayingTexture);
+    SpriteBatch(uint32 capacity = _d_sprite_batch_capacity)
+      : CAPACITY(capacity)
+    {
+      vertices = new Vertex[CAPACITY * 4];
+      indices = new GLushort[CAPACITY * 6];
 
-      _d_load_img(_d_app_res_nc, nightCityTexture);
-      _d_load_img(_d_app_res_nc_lights_1, nightCityLights1Texture);
+      // Quads never change their topology, so indices are built once.
+      for(uint32 i = 0; i < CAPACITY; i++)
+      {
+        GLushort *index = &indices[i * 6];
+        const GLushort vertex = (GLushort)(i * 4);
+
+        index[0] = vertex;
+        index[1] = vertex + 1;
+        index[2] = vertex + 2;
+        index[3] = vertex;
+        index[4] = vertex + 2;
+        index[5] = vertex + 3;
+      }
 
-      _d_load_img(_d_app_res_airplane, airplaneTexture);
-      _d_load_img(_d_app_res_airplane_lights_red, airplaneLightsRedTexture);
-      _d_load_img(_d_app_res_airplane_lights_green, airplaneLightsGreenTexture);
-      _d_load_img(_d_app_res_airplane_lights_white, airplaneLightsWhiteTexture);
+      texture = 0;
+      target = GL_TEXTURE_2D;
+      program = null;
+      quads = 0;
+      color = 0xffffffff;
 
-      //
-      nowPlaying = new NightCityEntity(Vector2d(_d_app_np_x, _d_app_np_y), *nowPlayingTexture, Fade(_d_app_np_fade));
+      drawCalls = 0;
+      frameDrawCalls = 0;
+    }
 
-      nightCity = new NightCityEntity(Vector2d(), *nightCityTexture);
-      nightCityLights1 = new NightCityEntity(Vector2d(), *nightCityLights1Texture, Fade(_d_app_nc_lights_1_fade));
+    ~SpriteBatch()
+    {
+      delete[] vertices;
+      delete[] indices;
+    }
 
-      airplane = new AirplaneEntity(
-        Line2d::Make(
-          // Reversed.
-          Vector2d(_d_app_airplane_landing_to_x, _d_app_airplane_landing_to_y),
-          Vector2d(_d_app_airplane_landing_from_x, _d_app_airplane_landing_from_y)),
-        *airplaneTexture,
-        *airplaneLightsRedTexture, *airplaneLightsGreenTexture, *airplaneLightsWhiteTexture,
-        Fade(_d_app_airplane_lights_fade, _d_app_airplane_lights_sleep));
+    void Begin()
+    {
+      glEnableClientState(GL_VERTEX_ARRAY);
+      glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+      glEnableClientState(GL_COLOR_ARRAY);
+
+      glVertexPointer(2, GL_FLOAT, sizeof(Vertex), &vertices[0].x);
+      glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &vertices[0].u);
+      glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), &vertices[0].color);
+
+      texture = 0;
+      target = GL_TEXTURE_2D;
+      program = null;
+      drawCalls = 0;
+      SetColor(1, 1, 1, 1);
     }
 
-    void Run()
+    void End()
     {
-      //
-      if(Mix_PlayMusic(blues, -1) == -1)
-        _d_log_fatal("Mix_PlayMusic(): " << SDL_GetError());
+      Flush();
 
-      //
-      TimeMgr::Time prevTime = TimeMgr::GetTicks();
-      {
-        airplane->time = prevTime;
-      }
+      glDisableClientState(GL_COLOR_ARRAY);
+      glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+      glDisableClientState(GL_VERTEX_ARRAY);
+
+      SetTarget(GL_TEXTURE_2D);
+      SetProgram(null);
+
+      frameDrawCalls = drawCalls;
+    }
+
+    // Replaces glColor4d(): the tint is stored per vertex, so changing it does not break the batch.
+    void SetColor(float64 r, float64 g, float64 b, float64 a)
+    {
+      color = PackColor(r, g, b, a);
+    }
+
+    // Quads drawn until the next call are shaded by the program, null restores fixed function.
+    void SetProgram(const FragmentProgram *fragmentProgram)
+    {
+      if(fragmentProgram == program)
+        return;
+
+      Flush();
+
+      if(program)
+        program->Disable();
+      if(fragmentProgram)
+        fragmentProgram->Enable();
+
+      program = fragmentProgram;
+    }
+
+    void Draw(GlTexture tex, GLenum texTarget, GLdouble x, GLdouble y, GLdouble width, GLdouble height,
+      GLdouble u0, GLdouble v0, GLdouble u1, GLdouble v1)
+    {
+      if(tex != texture || texTarget != target)
+      {
+        Flush();
+
+        SetTarget(texTarget);
+
+        texture = tex;
+        glBindTexture(target, texture);
+      }
+      elif(quads == CAPACITY)
+      {
+        Flush();
+      }
+
+      Vertex *v = &vertices[quads * 4];
+
+      SetVertex(v[0], x, y, u0, v0);
+      SetVertex(v[1], x + width, y, u1, v0);
+      SetVertex(v[2], x + width, y + height, u1, v1);
+      SetVertex(v[3], x, y + height, u0, v1);
+
+      quads++;
+    }
+
+    void Flush()
+    {
+      if(!quads)
+        return;
+
+      glDrawElements(GL_TRIANGLES, quads * 6, GL_UNSIGNED_SHORT, indices);
+      drawCalls++;
+
+      quads = 0;
+    }
+
+    // Draw calls issued between the last Begin()/End() pair.
+    uint32 GetDrawCalls() const
+    {
+      return frameDrawCalls;
+    }
+
+    static uint32 PackColor(float64 r, float64 g, float64 b, float64 a)
+    {
+      // GL_UNSIGNED_BYTE colors are read in memory order, i.e. RGBA on little endian.
+      return (uint32)(r * 255.0 + 0.5)
+        | ((uint32)(g * 255.0 + 0.5) << 8)
+        | ((uint32)(b * 255.0 + 0.5) << 16)
+        | ((uint32)(a * 255.0 + 0.5) << 24);
+    }
+
+  private:
+    struct Vertex
+    {
+      GLfloat x;
+      GLfloat y;
+      GLfloat u;
+      GLfloat v;
+      uint32 color;
+    };
+
+    Vertex *vertices;
+    GLushort *indices;
+
+    GlTexture texture;
+    GLenum target;
+    const FragmentProgram *program;
+    uint32 quads;
+    uint32 color;
+
+    uint32 drawCalls;
+    uint32 frameDrawCalls;
+
+    void SetTarget(GLenum texTarget)
+    {
+      if(texTarget == target)
+        return;
+
+      glDisable(target);
+      glEnable(texTarget);
+      target = texTarget;
+    }
+
+    void SetVertex(Vertex &v, GLdouble x, GLdouble y, GLdouble u, GLdouble tv)
+    {
+      v.x = (GLfloat)x;
+      v.y = (GLfloat)y;
+      v.u = (GLfloat)u;
+      v.v = (GLfloat)tv;
+      v.color = color;
+    }
+};
+
+//
+//
+//
+// Texel storage of a page. Masks only carry coverage, their color comes from the tint, so most
+// sprites need far less than 32 bits.
+class TextureFormat
+{
+  public:
+    enum Type
+    {
+      Rgba8,
+      Rgb8,
+      Rgb565,
+      LuminanceAlpha8,
+      Luminance8,
+      Alpha8,
+      Dxt1
+    };
+
+    static const char* GetName(Type type)
+    {
+      static const char *NAMES[] = {"RGBA8", "RGB8", "RGB565", "LA8", "L8", "A8", "DXT1"};
+
+      return NAMES[type];
+    }
+
+    static uint32 GetBits(Type type)
+    {
+      static const uint32 BITS[] = {32, 24, 16, 16, 8, 8, 4};
+
+      return BITS[type];
+    }
+
+    // The smallest format that draws the same under a glColor tint: white texels keep only alpha,
+    // grey ones luminance, opaque ones drop alpha. Lossy stores opaque color in 16 bits.
+    static Type Analyze(const SDL_Surface *surface, bool lossy)
+    {
+      const SDL_PixelFormat *format = surface->format;
+
+      if(format->BytesPerPixel != 4)
+        return format->Amask ? Rgba8 : (lossy ? Rgb565 : Rgb8);
+
+      bool opaque = true;
+      bool grey = true;
+      bool white = true;
+
+      for(GLint y = 0; y < surface->h && (opaque || grey); y++)
+      {
+        const uint32 *row = (const uint32 *)((const byte *)surface->pixels + y * surface->pitch);
+
+        for(GLint x = 0; x < surface->w; x++)
+        {
+          const uint32 r = (row[x] & format->Rmask) >> format->Rshift;
+          const uint32 g = (row[x] & format->Gmask) >> format->Gshift;
+          const uint32 b = (row[x] & format->Bmask) >> format->Bshift;
+          const uint32 a = format->Amask ? (row[x] & format->Amask) >> format->Ashift : 0xff;
+
+          opaque = opaque && a == 0xff;
+
+          // Color under zero alpha never shows.
+          if(!a)
+            continue;
+
+          grey = grey && r == g && g == b;
+          white = white && grey && r == 0xff;
+        }
+      }
+
+      if(white)
+        return Alpha8;
+      if(grey)
+        return opaque ? Luminance8 : LuminanceAlpha8;
+      if(opaque)
+        return lossy ? Rgb565 : Rgb8;
+
+      return Rgba8;
+    }
+
+    // Analyze() as configured, without compact textures the surface's own layout.
+    static Type Choose(const SDL_Surface *surface)
+    {
+      #if _d_enable_compact_textures
+        return Analyze(surface, _d_compact_textures_lossy != 0);
+      #else
+        return surface->format->Amask || surface->format->BytesPerPixel == 4 ? Rgba8 : Rgb8;
+      #endif
+    }
+};
+
+//
+//
+//
+class TexturePage;
+class Texture;
+class DamageRegion;
+
+void PremultiplyAlpha(SDL_Surface *rgba);
+
+// Everything App needs to draw a frame. GlRenderer draws with OpenGL, CpuRenderer composites
+// into an SDL software surface.
+class Renderer
+{
+  public:
+    virtual ~Renderer()
+    {
+      ;
+    }
+
+    // Null unless drawing with OpenGL.
+    virtual const GlCaps* GetGlCaps() const = 0;
+
+    // Frames since the back buffer was last drawn, 0 when unknown. See DamageTracker.
+    virtual uint32 GetBufferAge() const = 0;
+
+    virtual GLint GetTextureSize(GLint n) const = 0;
+    virtual GLint GetMaxTextureSize() const = 0;
+
+    // Copies the surface, the caller keeps it. The format is a request, see TexturePage::FORMAT.
+    virtual TexturePage* CreatePage(SDL_Surface *surface, TextureFormat::Type format) = 0;
+
+    // Contents undefined until filled with UpdatePage().
+    virtual TexturePage* CreateEmptyPage(GLint width, GLint height, TextureFormat::Type format) = 0;
+
+    // Copies rows y to y + rows - 1 of an RGBA surface of the page's size. Not between Begin() and End().
+    virtual void UpdatePage(TexturePage &page, const SDL_Surface *rgba, GLint y, GLint rows) = 0;
+
+    // Frees the page's texels, keeping the page. False when the renderer can not. See TextureManager.
+    virtual bool ReleasePage(TexturePage &page) = 0;
+
+    // Stores a released page's texels again from the RGBA surface it was created from.
+    virtual void RestorePage(TexturePage &page, const SDL_Surface *rgba) = 0;
+
+    virtual void Begin() = 0;
+    virtual void End() = 0;
+
+    // Null removes the clip rectangle.
+    virtual void SetClip(const Rect *rect) = 0;
+    virtual void Clear() = 0;
+
+    // Premultiplied, textures are too: color at most a draws over, a below color adds.
+    virtual void SetColor(float64 r, float64 g, float64 b, float64 a) = 0;
+    virtual void SetProgram(const FragmentProgram *program) = 0;
+    virtual void Draw(const Texture &texture, GLdouble x, GLdouble y) = 0;
+
+    // Only the part of the texture's texels, relative to its top left corner. See Texture::mesh.
+    virtual void Draw(const Texture &texture, GLdouble x, GLdouble y, const Rect &part) = 0;
+
+    // Shows the region of the frame drawn since Begin().
+    virtual void Present(const DamageRegion &region, bool fullRedraw) = 0;
+
+    // The last presented frame as 8-bit RGB, top row first.
+    virtual void ReadPixels(byte *rgb) const = 0;
+
+    // Draw calls issued by the last frame.
+    virtual uint32 GetDrawCalls() const = 0;
+};
+
+//
+//
+//
+class TexturePage
+{
+  public:
+    const GlTexture TEXTURE;
+    const GLenum TARGET;
+
+    const GLint WIDTH;
+    const GLint HEIGHT;
+
+    // What the renderer stores, CpuRenderer always keeps 32 bits.
+    const TextureFormat::Type FORMAT;
+
+    // Texels in CpuRenderer's framebuffer layout, null for GL pages.
+    uint32 *const PIXELS;
+
+    // Rows uploaded so far, from the top. Less than HEIGHT only while a TextureStreamer fills the page.
+    GLint residentRows;
+
+    TexturePage(GlTexture texture, GLenum target, GLint width, GLint height, TextureFormat::Type format)
+      : TEXTURE(texture), TARGET(target), WIDTH(width), HEIGHT(height), FORMAT(format), PIXELS(null), residentRows(height)
+    {
+      ;
+    }
+
+    // Takes ownership of pixels.
+    TexturePage(uint32 *pixels, GLint width, GLint height)
+      : TEXTURE(0), TARGET(GL_TEXTURE_2D), WIDTH(width), HEIGHT(height), FORMAT(TextureFormat::Rgba8), PIXELS(pixels),
+        residentRows(height)
+    {
+      ;
+    }
+
+    ~TexturePage()
+    {
+      if(TEXTURE)
+        glDeleteTextures(1, &TEXTURE);
+
+      delete[] PIXELS;
+    }
+
+    uint32 GetBytes() const
+    {
+      return WIDTH * HEIGHT * TextureFormat::GetBits(FORMAT) / 8;
+    }
+};
+
+// Sub-rectangle of a page. Pages are owned by a TextureManager, a Texture only refers to one.
+class Texture
+{
+  public:
+    TexturePage &page;
+
+    // Position within the page, in texels.
+    const GLint X;
+    const GLint Y;
+
+    const GLint WIDTH;
+    const GLint HEIGHT;
+
+    const GLdouble U0;
+    const GLdouble V0;
+    const GLdouble U1;
+    const GLdouble V1;
+
+    // Part of the sprite with non-transparent texels, in texels relative to its top left corner.
+    Rect visible;
+
+    // Texels per unit of the space it is drawn in, above 1 for assets resampled to the display.
+    GLdouble scale;
+
+    // Where the texels start within the source image, the optimizer cuts transparent borders off.
+    GLint trimX;
+    GLint trimY;
+
+    // Bands covering the non-transparent texels, relative to the top left corner. Drawn instead
+    // of the whole quad, most of a mostly transparent sprite is never filled. See BuildMesh().
+    Rect mesh[_d_texture_mesh_max_parts];
+    uint32 meshCount;
+
+    // Rectangle textures are addressed in texels rather than in [0, 1].
+    Texture(TexturePage &page, GLint x, GLint y, GLint width, GLint height)
+      : page(page), X(x), Y(y), WIDTH(width), HEIGHT(height),
+        U0((GLdouble)x / GetScale(page.TARGET, page.WIDTH)), V0((GLdouble)y / GetScale(page.TARGET, page.HEIGHT)),
+        U1((GLdouble)(x + width) / GetScale(page.TARGET, page.WIDTH)), V1((GLdouble)(y + height) / GetScale(page.TARGET, page.HEIGHT)),
+        visible(0, 0, width, height), scale(1.0), trimX(0), trimY(0), meshCount(1)
+    {
+      mesh[0] = Rect(0, 0, width, height);
+    }
+
+    operator GlTexture()
+    {
+      return page.TEXTURE;
+    }
+
+    // Of its page's storage.
+    uint32 GetBytes() const
+    {
+      return WIDTH * HEIGHT * TextureFormat::GetBits(page.FORMAT) / 8;
+    }
+
+    // Every texel has been uploaded, the texture can be drawn.
+    bool IsResident() const
+    {
+      return page.residentRows >= Y + HEIGHT;
+    }
+
+    Rect GetVisibleBounds(GLdouble x, GLdouble y) const
+    {
+      return Rect::Cover(x + visible.x / scale, y + visible.y / scale, visible.width / scale, visible.height / scale);
+    }
+
+    // Where part of the texels lands when the texture is drawn at x, y.
+    Rect GetBounds(GLdouble x, GLdouble y, const Rect &part) const
+    {
+      return Rect::Cover(x + (trimX + part.x) / scale, y + (trimY + part.y) / scale, part.width / scale, part.height / scale);
+    }
+
+    void DrawQuad(Renderer &renderer, GLdouble x, GLdouble y)
+    {
+      renderer.Draw(*this, x, y);
+    }
+
+    void DrawMesh(Renderer &renderer, GLdouble x, GLdouble y) const
+    {
+      for(uint32 i = 0; i < meshCount; i++)
+        renderer.Draw(*this, x, y, mesh[i]);
+    }
+
+    // Splits the rows with any alpha into at most _d_texture_mesh_max_parts bands, each as wide as
+    // its widest row. The split minimizes the texels filled plus _d_texture_mesh_part_cost per band.
+    // The texture's texels are those of the RGBA surface at x, y.
+    void BuildMesh(const SDL_Surface *rgba, GLint x, GLint y)
+    {
+      const uint32 PARTS = _d_texture_mesh_max_parts;
+      const uint32 ROWS = HEIGHT;
+
+      // Extents of each row, empty rows have left >= right.
+      GLint *left = new GLint[ROWS];
+      GLint *right = new GLint[ROWS];
+
+      for(uint32 r = 0; r < ROWS; r++)
+      {
+        const uint32 *row = (const uint32 *)((const byte *)rgba->pixels + (y + r) * rgba->pitch) + x;
+
+        left[r] = WIDTH;
+        right[r] = 0;
+        for(GLint c = 0; c < WIDTH; c++)
+          if(row[c] >> 24)
+          {
+            if(c < left[r])
+              left[r] = c;
+            right[r] = c + 1;
+          }
+      }
+
+      // cost[k][j]: rows 0 to j - 1 covered by at most k bands, from[k][j]: where the last band
+      // starts, ROWS if row j - 1 is empty and left out.
+      uint64 *cost = new uint64[(PARTS + 1) * (ROWS + 1)];
+      uint32 *from = new uint32[(PARTS + 1) * (ROWS + 1)];
+      const uint64 NONE = ~(uint64)0;
+
+      for(uint32 k = 0; k <= PARTS; k++)
+      {
+        uint64 *c = &cost[k * (ROWS + 1)];
+        uint32 *f = &from[k * (ROWS + 1)];
+        c[0] = 0;
+
+        for(uint32 j = 1; j <= ROWS; j++)
+        {
+          c[j] = NONE;
+          f[j] = ROWS;
+
+          if(left[j - 1] >= right[j - 1])
+            c[j] = c[j - 1];
+
+          if(!k)
+            continue;
+
+          const uint64 *prev = &cost[(k - 1) * (ROWS + 1)];
+          GLint l = WIDTH;
+          GLint r = 0;
+
+          for(uint32 i = j; i-- > 0;)
+          {
+            if(left[i] < l)
+              l = left[i];
+            if(right[i] > r)
+              r = right[i];
+
+            if(prev[i] == NONE || l >= r)
+              continue;
+
+            const uint64 total = prev[i] + (uint64)(j - i) * (r - l) + _d_texture_mesh_part_cost;
+            if(total < c[j])
+            {
+              c[j] = total;
+              f[j] = i;
+            }
+          }
+        }
+      }
+
+      //
+      meshCount = 0;
+      for(uint32 k = PARTS, j = ROWS; j > 0;)
+      {
+        const uint32 i = from[k * (ROWS + 1) + j];
+        if(i == ROWS)
+        {
+          j--;
+          continue;
+        }
+
+        GLint l = WIDTH;
+        GLint r = 0;
+        for(uint32 row = i; row < j; row++)
+        {
+          if(left[row] < l)
+            l = left[row];
+          if(right[row] > r)
+            r = right[row];
+        }
+
+        mesh[meshCount++] = Rect(l, i, r - l, j - i);
+        j = i;
+        k--;
+      }
+
+      delete[] left;
+      delete[] right;
+      delete[] cost;
+      delete[] from;
+    }
+
+  private:
+    static GLdouble GetScale(GLenum target, GLint size)
+    {
+      return target == GL_TEXTURE_RECTANGLE_ARB ? 1.0 : (GLdouble)size;
+    }
+};
+
+//
+//
+//
+class RectPacker
+{
+  public:
+    const GLint WIDTH;
+    const GLint HEIGHT;
+    const GLint PADDING;
+
+    RectPacker(GLint width, GLint height, GLint padding)
+      : WIDTH(width), HEIGHT(height), PADDING(padding),
+        shelfX(0), shelfY(0), shelfHeight(0), usedWidth(0), usedHeight(0)
+    {
+      ;
+    }
+
+    // Next-fit shelf packing. Rectangles are expected in order of decreasing height.
+    bool Insert(GLint width, GLint height, GLint &x, GLint &y)
+    {
+      GLint nextX = shelfX;
+      GLint nextY = shelfY;
+      GLint nextHeight = shelfHeight;
+
+      if(nextX + width > WIDTH)
+      {
+        nextX = 0;
+        nextY += shelfHeight + PADDING;
+        nextHeight = 0;
+      }
+
+      if(nextX + width > WIDTH || nextY + height > HEIGHT)
+        return false;
+
+      x = nextX;
+      y = nextY;
+
+      shelfX = nextX + width + PADDING;
+      shelfY = nextY;
+      shelfHeight = height > nextHeight ? height : nextHeight;
+
+      if(x + width > usedWidth)
+        usedWidth = x + width;
+      if(y + height > usedHeight)
+        usedHeight = y + height;
+
+      return true;
+    }
+
+    GLint GetUsedWidth() const
+    {
+      return usedWidth;
+    }
+
+    GLint GetUsedHeight() const
+    {
+      return usedHeight;
+    }
+
+  private:
+    GLint shelfX;
+    GLint shelfY;
+    GLint shelfHeight;
+
+    GLint usedWidth;
+    GLint usedHeight;
+};
+
+//
+//
+//
+SDL_Surface* CreateRgbaSurface(GLint width, GLint height)
+{
+  // RGBA in memory order on little endian, i.e. GL_RGBA + GL_UNSIGNED_BYTE.
+  SDL_Surface *rgba = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32,
+    0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+  if(!rgba)
+    _d_log_fatal(_d_file_line << ": " << SDL_GetError());
+
+  return rgba;
+}
+
+SDL_Surface* ConvertToRgba(SDL_Surface *surface)
+{
+  SDL_Surface *rgba = CreateRgbaSurface(surface->w, surface->h);
+
+  // Without SDL_SRCALPHA the blit copies alpha instead of blending with it.
+  SDL_SetAlpha(surface, 0, SDL_ALPHA_OPAQUE);
+  SDL_BlitSurface(surface, null, rgba, null);
+
+  return rgba;
+}
+
+// Alpha of three same-sized masks in the red, green and blue channels, their maximum in alpha.
+// Only alpha is kept, the masks are white and get their color from the tint.
+SDL_Surface* PackMasks(SDL_Surface *r, SDL_Surface *g, SDL_Surface *b)
+{
+  if(r->w != g->w || r->w != b->w || r->h != g->h || r->h != b->h)
+    return null;
+
+  SDL_Surface *masks[3] = {ConvertToRgba(r), ConvertToRgba(g), ConvertToRgba(b)};
+  SDL_Surface *packed = CreateRgbaSurface(r->w, r->h);
+
+  for(GLint y = 0; y < packed->h; y++)
+  {
+    uint32 *dest = (uint32 *)((byte *)packed->pixels + y * packed->pitch);
+
+    for(GLint x = 0; x < packed->w; x++)
+    {
+      uint32 alpha = 0;
+      uint32 texel = 0;
+
+      for(uint32 i = 0; i < 3; i++)
+      {
+        const uint32 a = ((const uint32 *)((const byte *)masks[i]->pixels + y * masks[i]->pitch))[x] >> 24;
+
+        texel |= a << (i * 8);
+        if(a > alpha)
+          alpha = a;
+      }
+
+      dest[x] = texel | (alpha << 24);
+    }
+  }
+
+  for(uint32 i = 0; i < 3; i++)
+    SDL_FreeSurface(masks[i]);
+
+  return packed;
+}
+
+// Lanczos-3 taps of one axis: for each destination texel the first source texel and count weights.
+// Shrinking widens the kernel by the ratio, so every source texel contributes.
+float32* GetLanczosTaps(GLint from, GLint to, GLint *first, GLint &taps)
+{
+  const float64 PI = 3.14159265358979323846;
+
+  const float64 ratio = (float64)to / (float64)from;
+  const float64 widen = ratio < 1.0 ? 1.0 / ratio : 1.0;
+  const float64 support = 3.0 * widen;
+
+  taps = (GLint)::ceil(support) * 2 + 1;
+  float32 *weights = new float32[to * taps];
+
+  for(GLint i = 0; i < to; i++)
+  {
+    const float64 center = ((float64)i + 0.5) / ratio - 0.5;
+    first[i] = (GLint)::floor(center - support) + 1;
+
+    float64 sum = 0;
+    for(GLint t = 0; t < taps; t++)
+    {
+      const float64 x = ((float64)(first[i] + t) - center) / widen;
+
+      float64 w = 0;
+      if(x == 0)
+        w = 1;
+      elif(x > -3.0 && x < 3.0)
+        w = 3.0 * ::sin(PI * x) * ::sin(PI * x / 3.0) / (PI * PI * x * x);
+
+      weights[i * taps + t] = (float32)w;
+      sum += w;
+    }
+
+    for(GLint t = 0; t < taps; t++)
+      weights[i * taps + t] = (float32)(weights[i * taps + t] / sum);
+  }
+
+  return weights;
+}
+
+// Resamples RGBA texels with a separable Lanczos-3 filter. Color is filtered premultiplied, so
+// transparent texels do not bleed into the edges of a sprite. Only touches memory, any thread may
+// call it.
+void ScaleRgba(const byte *srcPixels, GLint srcWidth, GLint srcHeight, uint32 srcPitch,
+  byte *destPixels, GLint width, GLint height, uint32 destPitch)
+{
+  GLint *firstX = new GLint[width];
+  GLint *firstY = new GLint[height];
+  GLint tapsX;
+  GLint tapsY;
+  float32 *weightsX = GetLanczosTaps(srcWidth, width, firstX, tapsX);
+  float32 *weightsY = GetLanczosTaps(srcHeight, height, firstY, tapsY);
+
+  // Source rows premultiplied, then the horizontal pass.
+  float32 *source = new float32[srcWidth * srcHeight * 4];
+  float32 *rows = new float32[width * srcHeight * 4];
+
+  for(GLint y = 0; y < srcHeight; y++)
+  {
+    const uint32 *row = (const uint32 *)(srcPixels + y * srcPitch);
+    float32 *dest = &source[y * srcWidth * 4];
+
+    for(GLint x = 0; x < srcWidth; x++)
+    {
+      const float32 a = (float32)(row[x] >> 24) / 255.0f;
+
+      dest[x * 4 + 0] = (float32)(row[x] & 0xff) * a;
+      dest[x * 4 + 1] = (float32)((row[x] >> 8) & 0xff) * a;
+      dest[x * 4 + 2] = (float32)((row[x] >> 16) & 0xff) * a;
+      dest[x * 4 + 3] = a * 255.0f;
+    }
+  }
+
+  for(GLint y = 0; y < srcHeight; y++)
+    for(GLint x = 0; x < width; x++)
+    {
+      float32 sum[4] = {0, 0, 0, 0};
+
+      for(GLint t = 0; t < tapsX; t++)
+      {
+        const GLint sx = firstX[x] + t < 0 ? 0 : (firstX[x] + t >= srcWidth ? srcWidth - 1 : firstX[x] + t);
+        const float32 w = weightsX[x * tapsX + t];
+        const float32 *texel = &source[(y * srcWidth + sx) * 4];
+
+        for(uint32 c = 0; c < 4; c++)
+          sum[c] += texel[c] * w;
+      }
+
+      for(uint32 c = 0; c < 4; c++)
+        rows[(y * width + x) * 4 + c] = sum[c];
+    }
+
+  //
+  for(GLint y = 0; y < height; y++)
+  {
+    uint32 *dest = (uint32 *)(destPixels + y * destPitch);
+
+    for(GLint x = 0; x < width; x++)
+    {
+      float32 sum[4] = {0, 0, 0, 0};
+
+      for(GLint t = 0; t < tapsY; t++)
+      {
+        const GLint sy = firstY[y] + t < 0 ? 0 : (firstY[y] + t >= srcHeight ? srcHeight - 1 : firstY[y] + t);
+        const float32 w = weightsY[y * tapsY + t];
+        const float32 *texel = &rows[(sy * width + x) * 4];
+
+        for(uint32 c = 0; c < 4; c++)
+          sum[c] += texel[c] * w;
+      }
+
+      // Lanczos rings, so results are clamped, and color can not exceed its alpha.
+      const float32 a = sum[3] < 0.0f ? 0.0f : (sum[3] > 255.0f ? 255.0f : sum[3]);
+      uint32 texel = (uint32)(a + 0.5f) << 24;
+
+      for(uint32 c = 0; c < 3 && a > 0.0f; c++)
+      {
+        const float32 v = sum[c] * 255.0f / a;
+        texel |= (uint32)((v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v)) + 0.5f) << (c * 8);
+      }
+
+      dest[x] = texel;
+    }
+  }
+
+  delete[] rows;
+  delete[] source;
+  delete[] weightsY;
+  delete[] weightsX;
+  delete[] firstY;
+  delete[] firstX;
+}
+
+SDL_Surface* ScaleRgba(const SDL_Surface *rgba, GLint width, GLint height)
+{
+  SDL_Surface *scaled = CreateRgbaSurface(width, height);
+
+  ScaleRgba((const byte *)rgba->pixels, rgba->w, rgba->h, rgba->pitch, (byte *)scaled->pixels, width, height, scaled->pitch);
+
+  return scaled;
+}
+
+//
+//
+//
+// Where a released page's texels come back from. See TextureManager.
+class PageSource
+{
+  public:
+    virtual ~PageSource()
+    {
+      ;
+    }
+
+    // An RGBA surface as the page was created from, null on failure.
+    virtual SDL_Surface* Load() = 0;
+};
+
+// Pages built at runtime keep a deflated copy of their texels, nothing on disk holds them.
+class MemoryPageSource : public PageSource
+{
+  public:
+    const GLint WIDTH;
+    const GLint HEIGHT;
+
+    // Copies the surface.
+    MemoryPageSource(const SDL_Surface *rgba)
+      : WIDTH(rgba->w), HEIGHT(rgba->h), data(null), size(0)
+    {
+      const uLong rawSize = WIDTH * HEIGHT * 4;
+      byte *raw = new byte[rawSize];
+
+      for(GLint y = 0; y < HEIGHT; y++)
+        memcpy(raw + y * WIDTH * 4, (const byte *)rgba->pixels + y * rgba->pitch, WIDTH * 4);
+
+      uLongf packedSize = compressBound(rawSize);
+      data = new byte[packedSize];
+
+      if(compress2(data, &packedSize, raw, rawSize, Z_BEST_SPEED) == Z_OK)
+        size = packedSize;
+      else
+        _d_log_warn("MemoryPageSource: compress2() failed");
+
+      delete[] raw;
+    }
+
+    ~MemoryPageSource()
+    {
+      delete[] data;
+    }
+
+    // Bytes kept.
+    uint32 GetSize() const
+    {
+      return size;
+    }
+
+    SDL_Surface* Load()
+    {
+      if(!size)
+        return null;
+
+      const uLong rawSize = WIDTH * HEIGHT * 4;
+      byte *raw = new byte[rawSize];
+      uLongf inflated = rawSize;
+
+      SDL_Surface *rgba = null;
+      if(uncompress(raw, &inflated, data, size) == Z_OK && inflated == rawSize)
+      {
+        rgba = CreateRgbaSurface(WIDTH, HEIGHT);
+
+        for(GLint y = 0; y < HEIGHT; y++)
+          memcpy((byte *)rgba->pixels + y * rgba->pitch, raw + y * WIDTH * 4, WIDTH * 4);
+      }
+
+      delete[] raw;
+
+      return rgba;
+    }
+
+  private:
+    byte *data;
+    uLongf size;
+};
+
+//
+//
+//
+// Owns every page and texture App draws and counts the bytes their texels take. With a budget,
+// pages nothing has drawn for the longest are released from the renderer once the resident ones
+// take more than it, and reloaded from their PageSource the next time a texture on them is used.
+class TextureManager
+{
+  public:
+    Renderer &renderer;
+
+    // Bytes, 0 for no limit.
+    const uint32 BUDGET;
+
+    struct Stats
+    {
+      // Use() of a resident page, and of a released one that had to be reloaded.
+      uint32 hits;
+      uint32 misses;
+
+      uint32 evictions;
+
+      uint32 residentBytes;
+      uint32 peakBytes;
+    };
+
+    TextureManager(Renderer &renderer, uint32 budget)
+      : renderer(renderer), BUDGET(budget), pageCount(0), textureCount(0), frame(0), overBudget(false)
+    {
+      memset(&stats, 0, sizeof(stats));
+    }
+
+    ~TextureManager()
+    {
+      for(uint32 i = 0; i < textureCount; i++)
+        delete textures[i];
+
+      for(uint32 i = 0; i < pageCount; i++)
+      {
+        delete pages[i].source;
+        delete pages[i].page;
+      }
+    }
+
+    // Takes ownership of both. Without a source the page is never released.
+    void AddPage(TexturePage *page, PageSource *source)
+    {
+      if(pageCount == _d_app_max_texture_pages)
+        _d_log_fatal("TextureManager: too many pages, max " << _d_app_max_texture_pages);
+
+      Entry &entry = pages[pageCount++];
+      entry.page = page;
+      entry.source = source;
+      entry.lastUse = frame;
+      entry.released = false;
+
+      AddResident(page->GetBytes());
+    }
+
+    // The RGBA surface the page was created from, copied only when there is a budget to enforce.
+    void AddPage(TexturePage *page, const SDL_Surface *rgba)
+    {
+      AddPage(page, BUDGET ? new MemoryPageSource(rgba) : (PageSource *)null);
+    }
+
+    // Takes ownership, the texture's page must have been added.
+    Texture* AddTexture(Texture *texture)
+    {
+      if(textureCount == _d_texture_manager_max_textures)
+        _d_log_fatal("TextureManager: too many textures, max " << _d_texture_manager_max_textures);
+
+      textures[textureCount++] = texture;
+
+      return texture;
+    }
+
+    uint32 GetPageCount() const
+    {
+      return pageCount;
+    }
+
+    TexturePage& GetPage(uint32 index) const
+    {
+      return *pages[index].page;
+    }
+
+    const Stats& GetStats() const
+    {
+      return stats;
+    }
+
+    void BeginFrame()
+    {
+      frame++;
+    }
+
+    // Before the texture is drawn this frame, not between Renderer::Begin() and End(). Reloads
+    // its page if it was released. False while the texture can not be drawn: still streaming,
+    // or the reload failed.
+    bool Use(const Texture &texture)
+    {
+      Entry *entry = Find(texture.page);
+      if(!entry)
+        return texture.IsResident();
+
+      entry->lastUse = frame;
+
+      if(entry->released)
+      {
+        stats.misses++;
+        if(entry->source)
+          Reload(*entry);
+      }
+      else
+      {
+        stats.hits++;
+      }
+
+      return texture.IsResident();
+    }
+
+    // After this frame's Use() calls. Releases the least recently used pages not used this frame
+    // until the rest fit the budget. Pages still streaming are left alone.
+    void Trim()
+    {
+      while(BUDGET && stats.residentBytes > BUDGET)
+      {
+        Entry *oldest = null;
+
+        for(uint32 i = 0; i < pageCount; i++)
+        {
+          Entry &entry = pages[i];
+
+          if(!entry.released && entry.source && entry.lastUse != frame && entry.page->residentRows == entry.page->HEIGHT
+            && (!oldest || entry.lastUse < oldest->lastUse))
+            oldest = &entry;
+        }
+
+        if(!oldest)
+        {
+          if(!overBudget)
+            _d_log_warn("TextureManager: a frame uses " << stats.residentBytes / 1024 << " KB, over the budget of "
+              << BUDGET / 1024 << " KB");
+
+          overBudget = true;
+          return;
+        }
+
+        // The renderer keeps it, so there is no point in asking again.
+        if(!renderer.ReleasePage(*oldest->page))
+        {
+          delete oldest->source;
+          oldest->source = null;
+          continue;
+        }
+
+        oldest->page->residentRows = 0;
+        oldest->released = true;
+
+        stats.residentBytes -= oldest->page->GetBytes();
+        stats.evictions++;
+      }
+    }
+
+    // Every page, then the totals.
+    void Report() const
+    {
+      for(uint32 i = 0; i < pageCount; i++)
+      {
+        const TexturePage &page = *pages[i].page;
+
+        uint32 count = 0;
+        for(uint32 t = 0; t < textureCount; t++)
+          if(&textures[t]->page == &page)
+            count++;
+
+        _d_log_info("Texture page: " << page.WIDTH << "*" << page.HEIGHT << ", " << TextureFormat::GetName(page.FORMAT)
+          << ", " << page.GetBytes() / 1024 << " KB, textures: " << count
+          << (pages[i].released ? ", released" : "") << (pages[i].source ? "" : ", pinned"));
+      }
+
+      _d_log_info("Textures: " << stats.residentBytes / 1024 << " KB resident, peak " << stats.peakBytes / 1024
+        << " KB, budget " << BUDGET / 1024 << " KB, hits " << stats.hits << ", misses " << stats.misses
+        << ", evictions " << stats.evictions);
+    }
+
+  private:
+    struct Entry
+    {
+      TexturePage *page;
+      PageSource *source;
+
+      // Frame of the last Use().
+      uint32 lastUse;
+      bool released;
+    };
+
+    Entry pages[_d_app_max_texture_pages];
+    uint32 pageCount;
+
+    Texture *textures[_d_texture_manager_max_textures];
+    uint32 textureCount;
+
+    uint32 frame;
+
+    Stats stats;
+    bool overBudget;
+
+    Entry* Find(const TexturePage &page)
+    {
+      for(uint32 i = 0; i < pageCount; i++)
+        if(pages[i].page == &page)
+          return &pages[i];
+
+      return null;
+    }
+
+    void AddResident(uint32 bytes)
+    {
+      stats.residentBytes += bytes;
+      if(stats.residentBytes > stats.peakBytes)
+        stats.peakBytes = stats.residentBytes;
+    }
+
+    // Synchronous, the texture is drawn right after. A page that fails stays released.
+    void Reload(Entry &entry)
+    {
+      SDL_Surface *rgba = entry.source->Load();
+      if(!rgba)
+      {
+        _d_log_err("TextureManager: failed to reload a " << entry.page->WIDTH << "*" << entry.page->HEIGHT << " page");
+
+        delete entry.source;
+        entry.source = null;
+        return;
+      }
+
+      renderer.RestorePage(*entry.page, rgba);
+      SDL_FreeSurface(rgba);
+
+      entry.page->residentRows = entry.page->HEIGHT;
+      entry.released = false;
+
+      AddResident(entry.page->GetBytes());
+    }
+};
+
+//
+//
+//
+// Fills pages made by Renderer::CreateEmptyPage() a few rows per frame, top to bottom,
+// so no single frame pays for a whole page. See Texture::IsResident().
+class TextureStreamer
+{
+  public:
+    Renderer &renderer;
+
+    TextureStreamer(Renderer &renderer)
+      : renderer(renderer), head(0), count(0)
+    {
+      ;
+    }
+
+    ~TextureStreamer()
+    {
+      for(uint32 i = head; i < count; i++)
+        SDL_FreeSurface(items[i].surface);
+    }
+
+    // Takes ownership of the surface, an RGBA image of the page's size.
+    void Add(TexturePage &page, SDL_Surface *surface)
+    {
+      if(count == _d_app_max_texture_pages)
+        _d_log_fatal("TextureStreamer: too many pages, max " << _d_app_max_texture_pages);
+
+      page.residentRows = 0;
+
+      Item &item = items[count++];
+      item.page = &page;
+      item.surface = surface;
+    }
+
+    bool IsDone() const
+    {
+      return head == count;
+    }
+
+    // Uploads up to budget bytes, and always at least one row.
+    void Update(uint32 budget)
+    {
+      while(head < count)
+      {
+        Item &item = items[head];
+        TexturePage &page = *item.page;
+
+        const uint32 rowBytes = page.WIDTH * 4;
+        GLint rows = (GLint)(budget / rowBytes);
+        if(rows < 1)
+          rows = 1;
+        if(rows > page.HEIGHT - page.residentRows)
+          rows = page.HEIGHT - page.residentRows;
+
+        renderer.UpdatePage(page, item.surface, page.residentRows, rows);
+        page.residentRows += rows;
+
+        if(page.residentRows == page.HEIGHT)
+        {
+          SDL_FreeSurface(item.surface);
+          head++;
+        }
+
+        if(rows * rowBytes >= budget)
+          return;
+
+        budget -= rows * rowBytes;
+      }
+    }
+
+  private:
+    struct Item
+    {
+      TexturePage *page;
+      SDL_Surface *surface;
+    };
+
+    Item items[_d_app_max_texture_pages];
+    uint32 head;
+    uint32 count;
+};
+
+//
+//
+//
+class TextureAtlas
+{
+  public:
+    Renderer &renderer;
+
+    const GLint PAGE_SIZE;
+
+    // Texture::scale of every sprite.
+    const GLdouble SCALE;
+
+    TextureAtlas(Renderer &renderer, GLint pageSize, GLdouble scale = 1.0)
+      : renderer(renderer), PAGE_SIZE(pageSize), SCALE(scale), count(0)
+    {
+      ;
+    }
+
+    ~TextureAtlas()
+    {
+      for(uint32 i = 0; i < count; i++)
+        SDL_FreeSurface(sprites[i].surface);
+    }
+
+    // Takes ownership of the surface. *dest is set by Build(). The format is chosen from straight
+    // color, the texels are stored premultiplied unless they are data rather than color.
+    void Add(SDL_Surface *surface, Texture **dest, bool premultiply = true)
+    {
+      if(count == _d_atlas_max_sprites)
+        _d_log_fatal("TextureAtlas: too many sprites, max " << _d_atlas_max_sprites);
+
+      Sprite &sprite = sprites[count++];
+      sprite.surface = ConvertToRgba(surface);
+      sprite.format = TextureFormat::Choose(sprite.surface);
+      sprite.dest = dest;
+
+      if(premultiply)
+        PremultiplyAlpha(sprite.surface);
+
+      sprite.page = 0;
+      sprite.x = 0;
+      sprite.y = 0;
+
+      SDL_FreeSurface(surface);
+    }
+
+    // Packs and uploads every added sprite into pages and textures the manager owns, returns the
+    // number of pages. A page holds sprites of one format. With a streamer the pages are only
+    // created, their contents are handed to it.
+    uint32 Build(TextureManager &textures, TextureStreamer *streamer = null)
+    {
+      uint32 order[_d_atlas_max_sprites];
+      for(uint32 i = 0; i < count; i++)
+        order[i] = i;
+
+      // Tallest first, as the shelf packer expects.
+      for(uint32 i = 1; i < count; i++)
+        for(uint32 j = i; j > 0 && sprites[order[j]].surface->h > sprites[order[j - 1]].surface->h; j--)
+        {
+          uint32 t = order[j];
+          order[j] = order[j - 1];
+          order[j - 1] = t;
+        }
+
+      //
+      RectPacker *packers[_d_atlas_max_sprites];
+      TextureFormat::Type formats[_d_atlas_max_sprites];
+      uint32 packerCount = 0;
+
+      for(uint32 i = 0; i < count; i++)
+      {
+        Sprite &sprite = sprites[order[i]];
+        const GLint w = sprite.surface->w;
+        const GLint h = sprite.surface->h;
+
+        bool packed = false;
+        for(uint32 p = 0; p < packerCount && !packed; p++)
+          if(formats[p] == sprite.format && packers[p]->Insert(w, h, sprite.x, sprite.y))
+          {
+            sprite.page = p;
+            packed = true;
+          }
+
+        if(!packed)
+        {
+          // Sprites larger than a page get a page of their own.
+          if(w <= PAGE_SIZE && h <= PAGE_SIZE)
+            packers[packerCount] = new RectPacker(PAGE_SIZE, PAGE_SIZE, _d_atlas_padding);
+          else
+            packers[packerCount] = new RectPacker(renderer.GetTextureSize(w), renderer.GetTextureSize(h), 0);
+
+          packers[packerCount]->Insert(w, h, sprite.x, sprite.y);
+          formats[packerCount] = sprite.format;
+          sprite.page = packerCount++;
+        }
+      }
+
+      //
+      for(uint32 p = 0; p < packerCount; p++)
+      {
+        const GLint width = renderer.GetTextureSize(packers[p]->GetUsedWidth());
+        const GLint height = renderer.GetTextureSize(packers[p]->GetUsedHeight());
+
+        SDL_Surface *page = CreateRgbaSurface(width, height);
+        SDL_FillRect(page, null, 0);
+
+        uint32 spriteCount = 0;
+        uint32 used = 0;
+        for(uint32 i = 0; i < count; i++)
+          if(sprites[i].page == p)
+          {
+            Blit(sprites[i], (uint32 *)page->pixels, page->pitch / sizeof(uint32));
+            spriteCount++;
+            used += sprites[i].surface->w * sprites[i].surface->h;
+          }
+
+        //
+        TexturePage *texturePage;
+        if(streamer)
+        {
+          texturePage = renderer.CreateEmptyPage(width, height, formats[p]);
+          textures.AddPage(texturePage, page);
+          streamer->Add(*texturePage, page);
+        }
+        else
+        {
+          texturePage = renderer.CreatePage(page, formats[p]);
+          textures.AddPage(texturePage, page);
+          SDL_FreeSurface(page);
+        }
+
+        for(uint32 i = 0; i < count; i++)
+          if(sprites[i].page == p)
+          {
+            Sprite &sprite = sprites[i];
+            *sprite.dest = textures.AddTexture(new Texture(*texturePage, sprite.x, sprite.y, sprite.surface->w, sprite.surface->h));
+            (*sprite.dest)->visible = GetVisibleRect(sprite.surface);
+            (*sprite.dest)->BuildMesh(sprite.surface, 0, 0);
+            (*sprite.dest)->scale = SCALE;
+          }
+
+        _d_log_info("Atlas page: " << width << "*" << height << ", " << TextureFormat::GetName(texturePage->FORMAT)
+          << ", sprites: " << spriteCount << ", used: " << (float64)used * 100.0 / (float64)(width * height) << "%"
+          << ", VRAM saved: " << GlCaps::GetPaddedBytes(width, height, 4) / 1024 << " KB");
+
+        delete packers[p];
+      }
+
+      return packerCount;
+    }
+
+    // Bounds of the texels with any alpha, empty for a blank surface.
+    static Rect GetVisibleRect(const SDL_Surface *surface)
+    {
+      Rect visible;
+
+      for(GLint y = 0; y < surface->h; y++)
+      {
+        const uint32 *row = (const uint32 *)((const byte *)surface->pixels + y * surface->pitch);
+
+        for(GLint x = 0; x < surface->w; x++)
+          if(row[x] >> 24)
+            visible.Union(Rect(x, y, 1, 1));
+      }
+
+      return visible;
+    }
+
+  private:
+    struct Sprite
+    {
+      SDL_Surface *surface;
+      TextureFormat::Type format;
+      Texture **dest;
+
+      uint32 page;
+      GLint x;
+      GLint y;
+    };
+
+    Sprite sprites[_d_atlas_max_sprites];
+    uint32 count;
+
+    static void Blit(const Sprite &sprite, uint32 *pixels, GLint pitch)
+    {
+      const SDL_Surface *surface = sprite.surface;
+
+      for(GLint y = 0; y < surface->h; y++)
+        memcpy(&pixels[(sprite.y + y) * pitch + sprite.x],
+          (const byte *)surface->pixels + y * surface->pitch,
+          surface->w * sizeof(uint32));
+    }
+};
+
+//
+//
+//
+// Sleeps at 0, fades in to 1, out to 0, and again, as a function of absolute time alone. No state,
+// so any frame can be evaluated on its own, in any order, and hours of uptime accumulate no error.
+class Fade
+{
+  public:
+    const uint32 FADE_MILLIS;
+    const uint32 SLEEP_MILLIS;
+
+    // When the first sleep starts. Before it the value is 0.
+    const TimeMgr::Time PHASE;
+
+    Fade()
+      : FADE_MILLIS(0), SLEEP_MILLIS(0), PHASE(0)
+    {
+      ;
+    }
+
+    Fade(uint32 fadeMillis, uint32 sleepMillis = 0, TimeMgr::Time phase = 0)
+      : FADE_MILLIS(fadeMillis), SLEEP_MILLIS(sleepMillis), PHASE(phase)
+    {
+      ;
+    }
+
+    // Length of one sleep, fade in and fade out.
+    uint32 GetPeriod() const
+    {
+      return SLEEP_MILLIS + FADE_MILLIS * 2;
+    }
+
+    float64 Calc(TimeMgr::Time time) const
+    {
+      if(!FADE_MILLIS || time < PHASE)
+        return 0;
+
+      // Whole milliseconds into the cycle, exact however long ago PHASE was.
+      const uint32 local = (uint32)((time - PHASE) % GetPeriod());
+      if(local < SLEEP_MILLIS)
+        return 0;
+
+      const uint32 fading = local - SLEEP_MILLIS;
+
+      return (float64)(fading < FADE_MILLIS ? fading : FADE_MILLIS * 2 - fading) / (float64)FADE_MILLIS;
+    }
+
+    // Earliest time the value can visibly change: the end of the sleep phase, or one 8-bit step
+    // of the fade while fading. The largest Time for a fade of 0, which stays 0.
+    TimeMgr::Time GetNextChange(TimeMgr::Time time) const
+    {
+      if(!FADE_MILLIS)
+        return ~(TimeMgr::Time)0;
+
+      if(time < PHASE)
+        return PHASE + SLEEP_MILLIS;
+
+      const uint32 local = (uint32)((time - PHASE) % GetPeriod());
+      if(local < SLEEP_MILLIS)
+        return time + (SLEEP_MILLIS - local);
+
+      const TimeMgr::Time step = FADE_MILLIS / 255;
+
+      return time + (step ? step : 1);
+    }
+};
+
+//
+//
+//
+// Keyframed tracks, one per property of a named entity, read from text:
+//
+//   # entity property time value [time value...]
+//   np alpha 19000 0 24000 1 29000 1 34000 0
+//
+// Times in milliseconds, non-decreasing, values linear in between and held past either end. Two
+// keys at the same time make a jump. Tracks are sorted by entity and property, each remembers the
+// key it was last evaluated at, so a frame costs O(1) per track and a seek O(log n).
+class Timeline
+{
+  public:
+    enum Property
+    {
+      Alpha,
+      X,
+      Y,
+
+      // Tint, multiplied with the texels. 1 without a track.
+      Red,
+      Green,
+      Blue,
+
+      PropertyCount
+    };
+
+    struct Key
+    {
+      TimeMgr::Time time;
+      float64 value;
+    };
+
+    ~Timeline()
+    {
+      delete[] tracks;
+      delete[] keys;
+    }
+
+    // Null, with the line logged, if the text does not parse. Modifies the text.
+    static Timeline* Parse(char *text)
+    {
+      char *const end = text + strlen(text);
+
+      uint32 trackCount = 0;
+      uint32 keyCount = 0;
+
+      // Counted first, then stored. Line breaks become terminators on the first pass.
+      for(uint32 pass = 0; pass < 2; pass++)
+      {
+        Timeline *timeline = pass ? new Timeline(trackCount, keyCount) : null;
+        char *line = text;
+        uint32 lineNumber = 0;
+
+        trackCount = 0;
+        keyCount = 0;
+
+        while(line < end)
+        {
+          char *next = line + strcspn(line, "\n");
+          *next = 0;
+          lineNumber++;
+
+          if(!ParseLine(line, timeline, trackCount, keyCount))
+          {
+            _d_log_err("Timeline: bad line " << lineNumber << ": " << line);
+            delete timeline;
+            return null;
+          }
+
+          line = next + 1;
+        }
+
+        if(timeline)
+        {
+          qsort(timeline->tracks, trackCount, sizeof(Track), CompareTracks);
+
+          for(uint32 i = 1; i < trackCount; i++)
+            if(!CompareTracks(&timeline->tracks[i - 1], &timeline->tracks[i]))
+            {
+              _d_log_err("Timeline: two tracks for " << timeline->tracks[i].entity << " " << GetPropertyName(timeline->tracks[i].property));
+              delete timeline;
+              return null;
+            }
+
+          return timeline;
+        }
+      }
+
+      return null;
+    }
+
+    // Null if it can not be read or parsed.
+    static Timeline* Read(SDL_RWops *rw)
+    {
+      const int size = SDL_RWseek(rw, 0, RW_SEEK_END);
+      SDL_RWseek(rw, 0, RW_SEEK_SET);
+      if(size < 0)
+        return null;
+
+      char *text = new char[size + 1];
+      text[size] = 0;
+
+      Timeline *timeline = !size || SDL_RWread(rw, text, size, 1) == 1 ? Parse(text) : null;
+      delete[] text;
+
+      return timeline;
+    }
+
+    // -1 when there is none.
+    int32 FindTrack(const char *entity, Property property) const
+    {
+      Track key;
+      strncpy(key.entity, entity, _d_timeline_name_length - 1);
+      key.entity[_d_timeline_name_length - 1] = 0;
+      key.property = property;
+
+      const Track *track = (const Track *)bsearch(&key, tracks, trackCount, sizeof(Track), CompareTracks);
+
+      return track ? (int32)(track - tracks) : -1;
+    }
+
+    // Missing tracks, index -1, give the default.
+    float64 Evaluate(int32 index, TimeMgr::Time time, float64 missing = 0)
+    {
+      if(index < 0)
+        return missing;
+
+      Track &track = tracks[index];
+      const Key *k = keys + track.first;
+
+      if(time <= k[0].time)
+        return k[0].value;
+      if(time >= k[track.count - 1].time)
+        return k[track.count - 1].value;
+
+      const uint32 i = Seek(track, time);
+
+      return k[i].value + (k[i + 1].value - k[i].value) * (float64)(time - k[i].time) / (float64)(k[i + 1].time - k[i].time);
+    }
+
+    // Earliest time the track's value can visibly change: its next key while it holds, while it
+    // moves one pixel of position or one 8-bit step of alpha and tint. The largest Time once past
+    // the last key.
+    TimeMgr::Time GetNextChange(int32 index, TimeMgr::Time time)
+    {
+      if(index < 0)
+        return ~(TimeMgr::Time)0;
+
+      Track &track = tracks[index];
+      const Key *k = keys + track.first;
+
+      if(time < k[0].time)
+        return k[0].time;
+      if(time >= k[track.count - 1].time)
+        return ~(TimeMgr::Time)0;
+
+      const uint32 i = Seek(track, time);
+
+      const float64 change = ::fabs(k[i + 1].value - k[i].value);
+      if(change == 0)
+        return k[i + 1].time;
+
+      const float64 unit = track.property == X || track.property == Y ? 1.0 : 1.0 / 255.0;
+      const TimeMgr::Time step = (TimeMgr::Time)((float64)(k[i + 1].time - k[i].time) * unit / change);
+
+      return time + (step ? step : 1);
+    }
+
+    // The keys of a track, in order.
+    const Key* GetKeys(int32 index, uint32 &count) const
+    {
+      count = tracks[index].count;
+
+      return keys + tracks[index].first;
+    }
+
+    static const char* GetPropertyName(Property property)
+    {
+      static const char *const NAMES[PropertyCount] = {"alpha", "x", "y", "red", "green", "blue"};
+
+      return NAMES[property];
+    }
+
+  private:
+    struct Track
+    {
+      char entity[_d_timeline_name_length];
+      Property property;
+
+      uint32 first;
+      uint32 count;
+
+      // Key the last evaluation fell after.
+      uint32 cursor;
+    };
+
+    Track *tracks;
+    uint32 trackCount;
+
+    Key *keys;
+
+    Timeline(uint32 trackCount, uint32 keyCount)
+      : tracks(new Track[trackCount]), trackCount(trackCount), keys(new Key[keyCount])
+    {
+      ;
+    }
+
+    // Counts tracks and keys into the indices, and stores them too when there is a timeline.
+    static bool ParseLine(char *line, Timeline *timeline, uint32 &trackIndex, uint32 &keyIndex)
+    {
+      line += strspn(line, " \t\r");
+      if(!*line || *line == '#')
+        return true;
+
+      char entity[_d_timeline_name_length];
+      char property[_d_timeline_name_length];
+      int read = 0;
+
+      // _d_timeline_name_length - 1.
+      if(sscanf(line, "%15s %15s%n", entity, property, &read) != 2)
+        return false;
+
+      uint32 p = 0;
+      while(p < PropertyCount && strcmp(property, GetPropertyName((Property)p)))
+        p++;
+      if(p == PropertyCount)
+        return false;
+
+      //
+      Track *track = timeline ? &timeline->tracks[trackIndex] : null;
+      if(track)
+      {
+        strcpy(track->entity, entity);
+        track->property = (Property)p;
+        track->first = keyIndex;
+        track->cursor = 0;
+      }
+
+      uint32 count = 0;
+      TimeMgr::Time last = 0;
+      char *c = line + read;
+
+      forever
+      {
+        c += strspn(c, " \t\r");
+        if(!*c)
+          break;
+
+        char *end;
+        const float64 time = strtod(c, &end);
+        if(end == c || time < 0)
+          return false;
+
+        c = end;
+        const float64 value = strtod(c, &end);
+        if(end == c)
+          return false;
+
+        c = end;
+
+        Key key;
+        key.time = (TimeMgr::Time)time;
+        key.value = value;
+
+        if(count && key.time < last)
+          return false;
+
+        if(timeline)
+          timeline->keys[keyIndex] = key;
+
+        last = key.time;
+        keyIndex++;
+        count++;
+      }
+
+      if(!count)
+        return false;
+
+      if(track)
+        track->count = count;
+
+      trackIndex++;
+
+      return true;
+    }
+
+    // Index of the last key at or before time, which lies within the track's keys. The cursor
+    // and the key after it are tried first, frames mostly move forward by less than a key.
+    uint32 Seek(Track &track, TimeMgr::Time time) const
+    {
+      const Key *k = keys + track.first;
+      uint32 i = track.cursor;
+
+      if(k[i].time <= time && time < k[i + 1].time)
+        return i;
+
+      if(i + 2 < track.count && k[i + 1].time <= time && time < k[i + 2].time)
+        return track.cursor = i + 1;
+
+      uint32 low = 0;
+      uint32 high = track.count - 1;
+
+      // k[low].time <= time < k[high].time.
+      while(high - low > 1)
+      {
+        const uint32 middle = low + (high - low) / 2;
+
+        if(k[middle].time <= time)
+          low = middle;
+        else
+          high = middle;
+      }
+
+      return track.cursor = low;
+    }
+
+    static int CompareTracks(const void *a, const void *b)
+    {
+      const Track &x = *(const Track *)a;
+      const Track &y = *(const Track *)b;
+
+      const int entity = strcmp(x.entity, y.entity);
+
+      return entity ? entity : (int)x.property - (int)y.property;
+    }
+};
+
+//
+//
+//
+class NightCityEntity
+{
+  public:
+    Vector2d pos;
+    Texture &texture;
+    Fade fade;
+
+    NightCityEntity(const Vector2d &position, Texture &texture)
+      : pos(position), texture(texture)
+    {
+      ;
+    }
+
+    NightCityEntity(const Vector2d &position, Texture &texture, const Fade &fade)
+      : pos(position), texture(texture), fade(fade)
+    {
+      ;
+    }
+};
+
+//
+//
+//
+class AirplaneEntity
+{
+  public:
+    // Where each landing starts over from.
+    const Line2d START;
+
+    // What is left of the landing, the airplane at its end.
+    Line2d path;
+
+    Texture &airplaneTexture;
+
+    Texture &lightsRedTexture;
+    Texture &lightsGreenTexture;
+    Texture &lightsWhiteTexture;
+
+    // All three masks packed into RGB, null when drawn in three passes.
+    Texture *lightsTexture;
+
+    Fade fade;
+
+    AirplaneEntity(const Line2d &path, Texture &airplaneTexture,
+      Texture &lightsRedTexture, Texture &lightsGreenTexture, Texture &lightsWhiteTexture,
+      const Fade &fade)
+      : START(path), path(path), airplaneTexture(airplaneTexture),
+        lightsRedTexture(lightsRedTexture), lightsGreenTexture(lightsGreenTexture), lightsWhiteTexture(lightsWhiteTexture),
+        lightsTexture(null),
+        fade(fade),
+        previous(path.GetAbsDirection())
+    {
+      ;
+    }
+
+    // One step of the simulation. Once landed it starts over, without a step in between to
+    // interpolate across.
+    void Step(GLdouble millis)
+    {
+      previous.Set(path.GetAbsDirection());
+
+      const GLdouble length = path.GetLength();
+      if(length <= 0)
+      {
+        path.Set(START);
+        previous.Set(path.GetAbsDirection());
+
+        return;
+      }
+
+      const GLdouble distance = _d_app_airplane_landing_speed * millis;
+      path.AddLength(length < distance ? -length : -distance);
+    }
+
+    // Between the last two steps, 0 at the previous one and 1 at the last.
+    Vector2d GetPosition(GLdouble alpha) const
+    {
+      const Vector2d current = path.GetAbsDirection();
+
+      return Vector2d(previous.GetX() + (current.GetX() - previous.GetX()) * alpha,
+        previous.GetY() + (current.GetY() - previous.GetY()) * alpha);
+    }
+
+    // Only the textures drawn are used, so none is released while the others are drawn: the lights
+    // only when they are, and then either the packed masks or the three separate ones. See
+    // TextureManager::Use().
+    bool Use(TextureManager &textures, bool lights) const
+    {
+      const bool airplane = textures.Use(airplaneTexture);
+      if(!lights)
+        return airplane;
+
+      if(lightsTexture)
+        return textures.Use(*lightsTexture) && airplane;
+
+      const bool red = textures.Use(lightsRedTexture);
+      const bool green = textures.Use(lightsGreenTexture);
+      const bool white = textures.Use(lightsWhiteTexture);
+
+      return airplane && red && green && white;
+    }
+
+  private:
+    Vector2d previous;
+};
+
+//
+//
+//
+class DamageRegion
+{
+  public:
+    DamageRegion()
+      : count(0)
+    {
+      ;
+    }
+
+    void Clear()
+    {
+      count = 0;
+    }
+
+    // Merges touching rectangles. When full, the pair with the smallest combined area is merged.
+    void Add(Rect rect)
+    {
+      if(rect.IsEmpty())
+        return;
+
+      for(uint32 i = 0; i < count; )
+        if(rects[i].Touches(rect))
+        {
+          rect.Union(rects[i]);
+          rects[i] = rects[--count];
+          i = 0;
+        }
+        else
+        {
+          i++;
+        }
+
+      if(count == _d_damage_max_rects)
+      {
+        uint32 best = 0;
+        GLint bestArea = 0;
+
+        for(uint32 i = 0; i < count; i++)
+        {
+          const GLint area = Rect(rects[i]).Union(rect).GetArea();
+          if(!i || area < bestArea)
+          {
+            best = i;
+            bestArea = area;
+          }
+        }
+
+        rect.Union(rects[best]);
+        rects[best] = rects[--count];
+
+        Add(rect);
+        return;
+      }
+
+      rects[count++] = rect;
+    }
+
+    void Add(const DamageRegion &region)
+    {
+      for(uint32 i = 0; i < region.count; i++)
+        Add(region.rects[i]);
+    }
+
+    uint32 GetCount() const
+    {
+      return count;
+    }
+
+    const Rect& Get(uint32 i) const
+    {
+      return rects[i];
+    }
+
+    GLint GetArea() const
+    {
+      GLint area = 0;
+      for(uint32 i = 0; i < count; i++)
+        area += rects[i].GetArea();
+
+      return area;
+    }
+
+  private:
+    Rect rects[_d_damage_max_rects];
+    uint32 count;
+};
+
+// Collects the previous and current bounds of every item whose appearance changed. With a known
+// buffer age N the back buffer is repainted where any of the last N frames changed, otherwise
+// (age 0) every frame is a full redraw.
+class DamageTracker
+{
+  public:
+    const Rect SCREEN;
+    const uint32 BUFFER_AGE;
+
+    DamageTracker(const Rect &screen, uint32 bufferAge)
+      : SCREEN(screen), BUFFER_AGE(bufferAge < _d_damage_max_age ? bufferAge : _d_damage_max_age)
+    {
+      for(uint32 i = 0; i < _d_damage_max_items; i++)
+        items[i].valid = false;
+
+      Invalidate();
+    }
+
+    void Invalidate()
+    {
+      invalid = BUFFER_AGE ? BUFFER_AGE : 1;
+    }
+
+    // key stands for everything besides bounds that affects the item's pixels, e.g. a packed tint.
+    void Update(uint32 id, const Rect &bounds, uint32 key)
+    {
+      Item &item = items[id];
+
+      if(item.valid && item.bounds == bounds && item.key == key)
+        return;
+
+      if(item.valid)
+        current.Add(Rect(item.bounds).Intersect(SCREEN));
+      current.Add(Rect(bounds).Intersect(SCREEN));
+
+      item.bounds = bounds;
+      item.key = key;
+      item.valid = true;
+    }
+
+    // Same as Update() with an empty rectangle, for items that are not drawn.
+    void Hide(uint32 id)
+    {
+      Update(id, Rect(), 0);
+    }
+
+    // Region of the back buffer to repaint this frame, empty when nothing has to be presented.
+    const DamageRegion& GetRegion()
+    {
+      region.Clear();
+
+      if(!BUFFER_AGE || invalid)
+      {
+        region.Add(SCREEN);
+      }
+      elif(current.GetCount())
+      {
+        region.Add(current);
+        for(uint32 i = 0; i + 1 < BUFFER_AGE; i++)
+          region.Add(history[i]);
+      }
+
+      return region;
+    }
+
+    bool IsFullRedraw() const
+    {
+      return region.GetCount() == 1 && region.Get(0) == SCREEN;
+    }
+
+    // Call after the back buffer has been presented.
+    void Present()
+    {
+      for(uint32 i = _d_damage_max_age - 1; i > 0; i--)
+        history[i] = history[i - 1];
+      history[0] = current;
+
+      current.Clear();
+
+      if(invalid)
+        invalid--;
+    }
+
+  private:
+    struct Item
+    {
+      Rect bounds;
+      uint32 key;
+      bool valid;
+    };
+
+    Item items[_d_damage_max_items];
+
+    DamageRegion current;
+    DamageRegion history[_d_damage_max_age];
+    DamageRegion region;
+
+    uint32 invalid;
+};
+
+//
+//
+//
+class GlRenderer : public Renderer
+{
+  public:
+    const uint32 WIDTH;
+    const uint32 HEIGHT;
+
+    // Space everything is drawn in, letterboxed into the window at the largest scale that fits.
+    const uint32 VIEW_WIDTH;
+    const uint32 VIEW_HEIGHT;
+
+    // offscreen draws the view into a framebuffer object of its own size, Present() stretches it to
+    // the window. Otherwise the view is drawn straight into the window.
+    GlRenderer(uint32 width, uint32 height, uint32 viewWidth, uint32 viewHeight, bool offscreen)
+      : WIDTH(width), HEIGHT(height), VIEW_WIDTH(viewWidth), VIEW_HEIGHT(viewHeight)
+    {
+      SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+      screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_OPENGL/*SDL_DOUBLEBUF | SDL_HWPALETTE | SDL_HWSURFACE*/);
+      if(!screen)
+        _d_log_fatal("Failed to initialize video: " << SDL_GetError());
+
+      //
+      caps = new GlCaps();
+      batch = new SpriteBatch();
+
+      uploadIndex = 0;
+      if(caps->pixelBuffer)
+        caps->glGenBuffersARB(2, uploadBuffers);
+
+      frameDrawCalls = 0;
+
+      viewScale = GetViewScale(WIDTH, HEIGHT, VIEW_WIDTH, VIEW_HEIGHT);
+      view = Rect::Cover((WIDTH - VIEW_WIDTH * viewScale) / 2.0, (HEIGHT - VIEW_HEIGHT * viewScale) / 2.0,
+        VIEW_WIDTH * viewScale, VIEW_HEIGHT * viewScale);
+
+      framebuffer = 0;
+      targetPage = null;
+      targetTexture = null;
+      if(offscreen)
+        CreateTarget();
+
+      //
+      glDisable(GL_DEPTH_TEST);
+      glEnable(GL_TEXTURE_2D);
+      glEnable(GL_BLEND);
+      // Premultiplied, one state for both over and additive draws.
+      glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+ 
+      glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+ 
+      glClear(GL_COLOR_BUFFER_BIT);
+
+      SetViewport();
+ 
+      glMatrixMode(GL_PROJECTION);
+      glLoadIdentity();
+ 
+      glOrtho(0.0f, VIEW_WIDTH, VIEW_HEIGHT, 0.0f, -1.0f, 1.0f);
+ 
+      glMatrixMode(GL_MODELVIEW);
+      glLoadIdentity();
+    }
+
+    ~GlRenderer()
+    {
+      if(framebuffer)
+        caps->glDeleteFramebuffersEXT(1, &framebuffer);
+
+      delete targetTexture;
+      delete targetPage;
+
+      if(caps->pixelBuffer)
+        caps->glDeleteBuffersARB(2, uploadBuffers);
+
+      delete batch;
+      delete caps;
+    }
+
+    const GlCaps* GetGlCaps() const
+    {
+      return caps;
+    }
+
+    // The framebuffer object keeps the previous frame.
+    uint32 GetBufferAge() const
+    {
+      return framebuffer ? 1 : _d_damage_buffer_age;
+    }
+
+    GLint GetTextureSize(GLint n) const
+    {
+      return caps->GetTextureSize(n);
+    }
+
+    GLint GetMaxTextureSize() const
+    {
+      return caps->maxTextureSize;
+    }
+
+    TexturePage* CreatePage(SDL_Surface *surface, TextureFormat::Type format)
+    {
+      GlTexture texture;
+      GLint colors;
+      GLenum textureFormat;
+
+      //
+      if(surface->w > caps->maxTextureSize || surface->h > caps->maxTextureSize)
+        _d_log_warn("width > maxTextureSize || height > maxTextureSize");
+
+      // Padded only when the driver has neither NPOT nor rectangle textures.
+      const GLint width = caps->GetTextureSize(surface->w);
+      const GLint height = caps->GetTextureSize(surface->h);
+      const GLenum target = caps->GetTextureTarget();
+
+      //
+      colors = surface->format->BytesPerPixel;
+      if(colors == 4)
+      {
+        if(surface->format->Rmask == 0x000000ff)
+          textureFormat = GL_RGBA;
+        else
+          textureFormat = GL_BGRA;
+      }
+      elif(colors == 3)
+      {
+        if(surface->format->Rmask == 0x000000ff)
+          textureFormat = GL_RGB;
+        else
+          textureFormat = GL_BGR;
+      }
+      else
+      {
+        _d_log_warn(_d_file_line);
+      }
+
+      // The driver compresses whole pages, S3TC blocks are 4*4 texels.
+      if(format == TextureFormat::Rgb565 && caps->s3tc && width % 4 == 0 && height % 4 == 0)
+        format = TextureFormat::Dxt1;
+
+      _d_log_info("Img: " << width << "*" << height << ", " << TextureFormat::GetName(format)
+        << ", VRAM saved: " << GlCaps::GetPaddedBytes(width, height, colors) / 1024 << " KB");
+ 
+      //
+      glGenTextures(1, &texture);
+      glBindTexture(target, texture);
+ 
+      glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST/*GL_LINEAR*/);
+      glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST/*GL_LINEAR*/);
+ 
+      // The driver converts to the internal format, dropping what the analysis found unused.
+      glTexImage2D(target, 0, GetInternalFormat(format), width, height, 0, textureFormat, GL_UNSIGNED_BYTE, null);
+      glTexSubImage2D(target, 0,
+        0, 0, surface->w, surface->h,
+        textureFormat, GL_UNSIGNED_BYTE, surface->pixels);
+
+      return new TexturePage(texture, target, width, height, format);
+    }
+
+    // Streamed pages are updated in bands of any height, so they are never compressed.
+    TexturePage* CreateEmptyPage(GLint width, GLint height, TextureFormat::Type format)
+    {
+      GlTexture texture;
+      const GLenum target = caps->GetTextureTarget();
+
+      glGenTextures(1, &texture);
+      glBindTexture(target, texture);
+
+      glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+      glTexImage2D(target, 0, GetInternalFormat(format), width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, null);
+
+      return new TexturePage(texture, target, width, height, format);
+    }
+
+    // Through a pixel buffer the copy into driver memory is ours and the transfer is asynchronous.
+    // The two buffers are orphaned before each use, so mapping never waits for the GPU.
+    void UpdatePage(TexturePage &page, const SDL_Surface *rgba, GLint y, GLint rows)
+    {
+      const byte *src = (const byte *)rgba->pixels + y * rgba->pitch;
+      const uint32 rowBytes = rgba->w * 4;
+
+      glBindTexture(page.TARGET, page.TEXTURE);
+
+      if(caps->pixelBuffer)
+      {
+        caps->glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, uploadBuffers[uploadIndex++ % 2]);
+        caps->glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, rows * rowBytes, null, GL_STREAM_DRAW_ARB);
+
+        byte *dest = (byte *)caps->glMapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+        if(dest)
+        {
+          for(GLint row = 0; row < rows; row++)
+            memcpy(dest + row * rowBytes, src + row * rgba->pitch, rowBytes);
+
+          caps->glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB);
+          glTexSubImage2D(page.TARGET, 0, 0, y, rgba->w, rows, GL_RGBA, GL_UNSIGNED_BYTE, null);
+        }
+        else
+        {
+          _d_log_warn("glMapBufferARB() failed");
+        }
+
+        caps->glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+      }
+      else
+      {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, rgba->pitch / 4);
+        glTexSubImage2D(page.TARGET, 0, 0, y, rgba->w, rows, GL_RGBA, GL_UNSIGNED_BYTE, src);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+      }
+    }
+
+    // A zero sized image keeps the name and parameters, the driver frees the storage.
+    bool ReleasePage(TexturePage &page)
+    {
+      glBindTexture(page.TARGET, page.TEXTURE);
+      glTexImage2D(page.TARGET, 0, GetInternalFormat(page.FORMAT), 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, null);
+
+      return true;
+    }
+
+    void RestorePage(TexturePage &page, const SDL_Surface *rgba)
+    {
+      glBindTexture(page.TARGET, page.TEXTURE);
+      glTexImage2D(page.TARGET, 0, GetInternalFormat(page.FORMAT), page.WIDTH, page.HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, null);
+
+      UpdatePage(page, rgba, 0, rgba->h);
+    }
+
+    void Begin()
+    {
+      if(framebuffer)
+        caps->glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, framebuffer);
+
+      SetViewport();
+
+      batch->Begin();
+    }
+
+    void End()
+    {
+      batch->End();
+
+      frameDrawCalls = batch->GetDrawCalls();
+    }
+
+    void SetClip(const Rect *rect)
+    {
+      // The scissor rectangle applies at draw time.
+      batch->Flush();
+
+      if(rect)
+      {
+        // In window pixels, covering the scaled rectangle. GL's window origin is bottom left.
+        const Rect r = framebuffer ? *rect
+          : Rect::Cover(view.x + rect->x * viewScale, view.y + rect->y * viewScale, rect->width * viewScale, rect->height * viewScale);
+        const GLint height = framebuffer ? VIEW_HEIGHT : HEIGHT;
+
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(r.x, height - r.y - r.height, r.width, r.height);
+      }
+      else
+      {
+        glDisable(GL_SCISSOR_TEST);
+      }
+    }
+
+    void Clear()
+    {
+      glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    void SetColor(float64 r, float64 g, float64 b, float64 a)
+    {
+      batch->SetColor(r, g, b, a);
+    }
+
+    void SetProgram(const FragmentProgram *program)
+    {
+      batch->SetProgram(program);
+    }
+
+    void Draw(const Texture &texture, GLdouble x, GLdouble y)
+    {
+      Draw(texture, x, y, Rect(0, 0, texture.WIDTH, texture.HEIGHT));
+    }
+
+    void Draw(const Texture &texture, GLdouble x, GLdouble y, const Rect &part)
+    {
+      const GLdouble du = (texture.U1 - texture.U0) / texture.WIDTH;
+      const GLdouble dv = (texture.V1 - texture.V0) / texture.HEIGHT;
+
+      batch->Draw(texture.page.TEXTURE, texture.page.TARGET,
+        x + (texture.trimX + part.x) / texture.scale, y + (texture.trimY + part.y) / texture.scale,
+        part.width / texture.scale, part.height / texture.scale,
+        texture.U0 + part.x * du, texture.V0 + part.y * dv,
+        texture.U0 + (part.x + part.width) * du, texture.V0 + (part.y + part.height) * dv);
+    }
+
+    void Present(const DamageRegion &/*region*/, bool /*fullRedraw*/)
+    {
+      if(framebuffer)
+      {
+        caps->glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+
+        // The letterbox bars too.
+        glDisable(GL_SCISSOR_TEST);
+        glViewport(0, 0, WIDTH, HEIGHT);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        SetViewport();
+
+        // A copy, the view's alpha is not coverage. Rendered bottom up, so V is flipped.
+        glDisable(GL_BLEND);
+        batch->Begin();
+        batch->Draw(targetPage->TEXTURE, targetPage->TARGET, 0, 0, VIEW_WIDTH, VIEW_HEIGHT,
+          targetTexture->U0, targetTexture->V1, targetTexture->U1, targetTexture->V0);
+        batch->End();
+        glEnable(GL_BLEND);
+      }
+
+      SDL_GL_SwapBuffers();
+    }
+
+    void ReadPixels(byte *rgb) const
+    {
+      glReadBuffer(GL_FRONT);
+      glPixelStorei(GL_PACK_ALIGNMENT, 1);
+      glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+      glReadBuffer(GL_BACK);
+
+      // GL's window origin is bottom left.
+      byte *row = new byte[WIDTH * 3];
+      for(uint32 y = 0; y < HEIGHT / 2; y++)
+      {
+        memcpy(row, rgb + y * WIDTH * 3, WIDTH * 3);
+        memcpy(rgb + y * WIDTH * 3, rgb + (HEIGHT - 1 - y) * WIDTH * 3, WIDTH * 3);
+        memcpy(rgb + (HEIGHT - 1 - y) * WIDTH * 3, row, WIDTH * 3);
+      }
+      delete[] row;
+    }
+
+    uint32 GetDrawCalls() const
+    {
+      return frameDrawCalls;
+    }
+
+    // Largest scale at which a view fits into the window.
+    static GLdouble GetViewScale(uint32 width, uint32 height, uint32 viewWidth, uint32 viewHeight)
+    {
+      const GLdouble x = (GLdouble)width / (GLdouble)viewWidth;
+      const GLdouble y = (GLdouble)height / (GLdouble)viewHeight;
+
+      return x < y ? x : y;
+    }
+
+  private:
+    SDL_Surface *screen;
+
+    GlCaps *caps;
+    SpriteBatch *batch;
+
+    GLuint uploadBuffers[2];
+    uint32 uploadIndex;
+
+    // Present() draws too, so the frame's count is kept at End().
+    uint32 frameDrawCalls;
+
+    // The view within the window, in window pixels from the top left.
+    GLdouble viewScale;
+    Rect view;
+
+    // Zero unless drawing offscreen.
+    GLuint framebuffer;
+    TexturePage *targetPage;
+    Texture *targetTexture;
+
+    void CreateTarget()
+    {
+      if(!caps->framebufferObject)
+      {
+        _d_log_warn("No framebuffer objects, drawing straight into the window.");
+        return;
+      }
+
+      targetPage = CreateEmptyPage(GetTextureSize(VIEW_WIDTH), GetTextureSize(VIEW_HEIGHT), TextureFormat::Rgba8);
+      targetTexture = new Texture(*targetPage, 0, 0, VIEW_WIDTH, VIEW_HEIGHT);
+
+      // Filtered once per frame when stretched to the window.
+      glTexParameteri(targetPage->TARGET, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(targetPage->TARGET, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+      caps->glGenFramebuffersEXT(1, &framebuffer);
+      caps->glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, framebuffer);
+      caps->glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, targetPage->TARGET, targetPage->TEXTURE, 0);
+
+      const GLenum status = caps->glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+      if(status == GL_FRAMEBUFFER_COMPLETE_EXT)
+        glClear(GL_COLOR_BUFFER_BIT);
+
+      caps->glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+
+      if(status != GL_FRAMEBUFFER_COMPLETE_EXT)
+      {
+        _d_log_warn("Framebuffer object incomplete (" << status << "), drawing straight into the window.");
+
+        caps->glDeleteFramebuffersEXT(1, &framebuffer);
+        framebuffer = 0;
+      }
+    }
+
+    // The whole offscreen target, or the view's rectangle of the window.
+    void SetViewport()
+    {
+      if(framebuffer)
+        glViewport(0, 0, VIEW_WIDTH, VIEW_HEIGHT);
+      else
+        glViewport(view.x, HEIGHT - view.y - view.height, view.width, view.height);
+    }
+
+    // GL_RGB565 is only core since 4.1, drivers store GL_RGB5 as 5:6:5. Premultiplied masks are
+    // white times alpha, which GL_INTENSITY8 stores in one channel and returns in all four.
+    static GLint GetInternalFormat(TextureFormat::Type format)
+    {
+      static const GLint FORMATS[] =
+      {
+        GL_RGBA8, GL_RGB8, GL_RGB5, GL_LUMINANCE8_ALPHA8, GL_LUMINANCE8, GL_INTENSITY8, GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+      };
+
+      return FORMATS[format];
+    }
+};
+
+//
+//
+//
+class CpuFeatures
+{
+  public:
+    static bool HasSse2()
+    {
+      #if _d_arch_x64
+        return true;
+      #elif _d_cc_msc
+        int info[4];
+        __cpuid(info, 1);
+
+        return (info[3] & (1 << 26)) != 0;
+      #else
+        return __builtin_cpu_supports("sse2");
+      #endif
+    }
+
+    // Also checks that the OS saves the YMM registers.
+    static bool HasAvx2()
+    {
+      #if !_d_compositor_avx2
+        return false;
+      #elif _d_cc_msc
+        int info[4];
+        __cpuid(info, 1);
+
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        if(!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+          return false;
+
+        __cpuidex(info, 7, 0);
+
+        return (info[1] & (1 << 5)) != 0;
+      #else
+        return __builtin_cpu_supports("avx2");
+      #endif
+    }
+
+    static uint32 GetCoreCount()
+    {
+      #if _d_os_win
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+
+        return info.dwNumberOfProcessors;
+      #else
+        const long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+        return count > 0 ? (uint32)count : 1;
+      #endif
+    }
+};
+
+//
+//
+//
+// Kernels compositing a span of premultiplied texels over the framebuffer: the texel is modulated
+// by the tint, then blended with ONE, ONE_MINUS_SRC_ALPHA. All math is 8-bit fixed point with exact
+// rounding, so every kernel produces the same bits. A is the index of the alpha byte.
+inline uint32 Div255(uint32 x)
+{
+  x += 128;
+
+  return (x + (x >> 8)) >> 8;
+}
+
+template<int A> void BlendSpanScalar(uint32 *dst, const uint32 *src, uint32 count, uint32 tint)
+{
+  for(uint32 i = 0; i < count; i++)
+  {
+    const uint32 texel = src[i];
+
+    // Transparent texels have no color either.
+    if(!((texel >> (A * 8)) & 0xff))
+      continue;
+
+    const uint32 pixel = dst[i];
+    const uint32 inverse = 255 - Div255(((texel >> (A * 8)) & 0xff) * ((tint >> (A * 8)) & 0xff));
+    uint32 out = 0;
+
+    for(uint32 c = 0; c < 4; c++)
+    {
+      const uint32 s = Div255(((texel >> (c * 8)) & 0xff) * ((tint >> (c * 8)) & 0xff));
+      const uint32 d = Div255(((pixel >> (c * 8)) & 0xff) * inverse);
+
+      // Additive tints saturate.
+      out |= (s + d > 0xff ? 0xff : s + d) << (c * 8);
+    }
+
+    dst[i] = out;
+  }
+}
+
+#if _d_compositor_sse2
+  inline __m128i Div255Sse2(__m128i x)
+  {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+  }
+
+  // Two pixels, one 16-bit lane per channel.
+  template<int A> inline __m128i BlendSse2(__m128i s, __m128i d, __m128i tint)
+  {
+    s = Div255Sse2(_mm_mullo_epi16(s, tint));
+
+    const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(A, A, A, A)), _MM_SHUFFLE(A, A, A, A));
+    const __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+
+    // At most 510 per lane, packing saturates.
+    return _mm_add_epi16(s, Div255Sse2(_mm_mullo_epi16(d, inverse)));
+  }
+
+  template<int A> void BlendSpanSse2(uint32 *dst, const uint32 *src, uint32 count, uint32 tint)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tint16 = _mm_unpacklo_epi8(_mm_set1_epi32(tint), zero);
+    const __m128i alphaMask = _mm_set1_epi32(0xff << (A * 8));
+
+    uint32 i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+      const __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+
+      // Fully transparent texels leave the framebuffer as is.
+      if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alphaMask), zero)) == 0xffff)
+        continue;
+
+      const __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+      const __m128i lo = BlendSse2<A>(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), tint16);
+      const __m128i hi = BlendSse2<A>(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), tint16);
+
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    BlendSpanScalar<A>(dst + i, src + i, count - i, tint);
+  }
+#endif
+
+#if _d_compositor_avx2
+  #if _d_cc_gnu
+    #define _d_target_avx2 __attribute__((target("avx2")))
+  #else
+    #define _d_target_avx2
+  #endif
+
+  _d_target_avx2 inline __m256i Div255Avx2(__m256i x)
+  {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+  }
+
+  // Four pixels, two in each 128-bit lane.
+  template<int A> _d_target_avx2 inline __m256i BlendAvx2(__m256i s, __m256i d, __m256i tint)
+  {
+    s = Div255Avx2(_mm256_mullo_epi16(s, tint));
+
+    const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(A, A, A, A)), _MM_SHUFFLE(A, A, A, A));
+    const __m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+
+    return _mm256_add_epi16(s, Div255Avx2(_mm256_mullo_epi16(d, inverse)));
+  }
+
+  template<int A> _d_target_avx2 void BlendSpanAvx2(uint32 *dst, const uint32 *src, uint32 count, uint32 tint)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i tint16 = _mm256_unpacklo_epi8(_mm256_set1_epi32(tint), zero);
+    const __m256i alphaMask = _mm256_set1_epi32(0xff << (A * 8));
+
+    uint32 i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+      const __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+
+      if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, alphaMask), zero)) == -1)
+        continue;
+
+      const __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+      // unpack and pack both work within 128-bit lanes, so pixel order is preserved.
+      const __m256i lo = BlendAvx2<A>(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), tint16);
+      const __m256i hi = BlendAvx2<A>(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), tint16);
+
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    BlendSpanScalar<A>(dst + i, src + i, count - i, tint);
+  }
+#endif
+
+typedef void (*BlendSpanFunc)(uint32 *dst, const uint32 *src, uint32 count, uint32 tint);
+
+template<int A> BlendSpanFunc SelectBlendSpan(const char *&name)
+{
+  #if _d_compositor_avx2
+    if(CpuFeatures::HasAvx2())
+    {
+      name = "AVX2";
+      return BlendSpanAvx2<A>;
+    }
+  #endif
+
+  #if _d_compositor_sse2
+    if(CpuFeatures::HasSse2())
+    {
+      name = "SSE2";
+      return BlendSpanSse2<A>;
+    }
+  #endif
+
+  name = "scalar";
+  return BlendSpanScalar<A>;
+}
+
+// Textures are stored premultiplied, converted once at load with the kernels' rounding.
+inline uint32 PremultiplyTexel(uint32 texel)
+{
+  const uint32 alpha = texel >> 24;
+
+  return Div255((texel & 0xff) * alpha)
+    | (Div255(((texel >> 8) & 0xff) * alpha) << 8)
+    | (Div255(((texel >> 16) & 0xff) * alpha) << 16)
+    | (texel & 0xff000000);
+}
+
+// In place, on a CreateRgbaSurface() surface.
+void PremultiplyAlpha(SDL_Surface *rgba)
+{
+  #if _d_compositor_sse2
+    const bool sse2 = CpuFeatures::HasSse2();
+  #endif
+
+  for(GLint y = 0; y < rgba->h; y++)
+  {
+    uint32 *row = (uint32 *)((byte *)rgba->pixels + y * rgba->pitch);
+    GLint x = 0;
+
+    #if _d_compositor_sse2
+      if(sse2)
+      {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i alphaMask = _mm_set1_epi32(0xff000000);
+
+        // Alpha lanes are scaled by 255, i.e. kept.
+        const __m128i colorLanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i alphaLanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+
+        for(; x + 4 <= rgba->w; x += 4)
+        {
+          const __m128i p = _mm_loadu_si128((const __m128i *)(row + x));
+
+          // Opaque texels stay as they are, most of a background.
+          if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(p, alphaMask), alphaMask)) == 0xffff)
+            continue;
+
+          __m128i lo = _mm_unpacklo_epi8(p, zero);
+          __m128i hi = _mm_unpackhi_epi8(p, zero);
+
+          const __m128i alphaLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+          const __m128i alphaHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+          lo = Div255Sse2(_mm_mullo_epi16(lo, _mm_or_si128(_mm_and_si128(alphaLo, colorLanes), alphaLanes)));
+          hi = Div255Sse2(_mm_mullo_epi16(hi, _mm_or_si128(_mm_and_si128(alphaHi, colorLanes), alphaLanes)));
+
+          _mm_storeu_si128((__m128i *)(row + x), _mm_packus_epi16(lo, hi));
+        }
+      }
+    #endif
+
+    for(; x < rgba->w; x++)
+      row[x] = PremultiplyTexel(row[x]);
+  }
+}
+
+//
+//
+//
+// Many fades, evaluated for one time in a pass over arrays of their parameters, two or four at a
+// time with SSE2 or AVX2. The math is Fade::Calc() in doubles, every kernel writes the same bits.
+class FadeBank
+{
+  public:
+    enum Kernel
+    {
+      KernelScalar,
+      KernelSse2,
+      KernelAvx2,
+
+      KernelCount
+    };
+
+    const uint32 CAPACITY;
+
+    FadeBank(uint32 capacity)
+      : CAPACITY(capacity), count(0),
+        phase(new float64[capacity]), fade(new float64[capacity]), sleep(new float64[capacity]),
+        period(new float64[capacity]), inversePeriod(new float64[capacity]), alphas(new float32[capacity]),
+        kernel(KernelScalar)
+    {
+      for(uint32 k = KernelCount; k-- > 0 && !SetKernel((Kernel)k);)
+        ;
+    }
+
+    ~FadeBank()
+    {
+      delete[] phase;
+      delete[] fade;
+      delete[] sleep;
+      delete[] period;
+      delete[] inversePeriod;
+      delete[] alphas;
+    }
+
+    // Returns its index into GetAlphas().
+    uint32 Add(const Fade &source)
+    {
+      if(count == CAPACITY)
+        _d_log_fatal("FadeBank: full, capacity " << CAPACITY);
+
+      // A fade of 0 stays 0, any period keeps the math finite.
+      phase[count] = (float64)source.PHASE;
+      fade[count] = source.FADE_MILLIS;
+      sleep[count] = source.SLEEP_MILLIS;
+      period[count] = source.FADE_MILLIS ? source.GetPeriod() : 1;
+      inversePeriod[count] = 1.0 / period[count];
+      alphas[count] = 0;
+
+      return count++;
+    }
+
+    uint32 GetCount() const
+    {
+      return count;
+    }
+
+    // False if the build or the CPU lacks it.
+    bool SetKernel(Kernel kernel)
+    {
+      if((kernel == KernelSse2 && !(_d_compositor_sse2 && CpuFeatures::HasSse2()))
+        || (kernel == KernelAvx2 && !CpuFeatures::HasAvx2()))
+        return false;
+
+      this->kernel = kernel;
+
+      return true;
+    }
+
+    Kernel GetKernel() const
+    {
+      return kernel;
+    }
+
+    static const char* GetKernelName(Kernel kernel)
+    {
+      static const char *const NAMES[KernelCount] = {"scalar", "SSE2", "AVX2"};
+
+      return NAMES[kernel];
+    }
+
+    // Every fade at time, times up to 2^52 ms. Read the values with GetAlphas().
+    void Evaluate(TimeMgr::Time time)
+    {
+      const float64 t = (float64)time;
+      uint32 i = 0;
+
+      #if _d_compositor_avx2
+        if(kernel == KernelAvx2)
+          i = EvaluateAvx2(t);
+      #endif
+
+      #if _d_compositor_sse2
+        if(kernel == KernelSse2)
+          i = EvaluateSse2(t);
+      #endif
+
+      for(; i < count; i++)
+        alphas[i] = EvaluateScalar(i, t);
+    }
+
+    // In Add() order, contiguous.
+    const float32* GetAlphas() const
+    {
+      return alphas;
+    }
+
+  private:
+    uint32 count;
+
+    float64 *phase;
+    float64 *fade;
+    float64 *sleep;
+    float64 *period;
+    float64 *inversePeriod;
+
+    float32 *alphas;
+
+    Kernel kernel;
+
+    // Whole milliseconds in doubles are exact, and so is the position in the cycle once the
+    // quotient's rounding is corrected for.
+    float32 EvaluateScalar(uint32 i, float64 t) const
+    {
+      const float64 elapsed = t - phase[i];
+
+      float64 local = elapsed - ::floor(elapsed * inversePeriod[i]) * period[i];
+      if(local < 0)
+        local += period[i];
+      elif(local >= period[i])
+        local -= period[i];
+
+      const float64 fading = local - sleep[i];
+      const float64 value = fading < fade[i] * 2 - fading ? fading : fade[i] * 2 - fading;
+
+      return elapsed >= 0 && fading >= 0 && fade[i] > 0 ? (float32)(value / fade[i]) : 0;
+    }
+
+    #if _d_compositor_sse2
+      // Returns how many were evaluated.
+      uint32 EvaluateSse2(float64 t)
+      {
+        const __m128d time = _mm_set1_pd(t);
+        const __m128d zero = _mm_setzero_pd();
+        const __m128d one = _mm_set1_pd(1.0);
+
+        // Adding 2^52 rounds to an integer, SSE2 has no floor.
+        const __m128d magic = _mm_set1_pd(4503599627370496.0);
+
+        uint32 i = 0;
+        for(; i + 2 <= count; i += 2)
+        {
+          const __m128d p = _mm_loadu_pd(period + i);
+          const __m128d f = _mm_loadu_pd(fade + i);
+
+          const __m128d elapsed = _mm_sub_pd(time, _mm_loadu_pd(phase + i));
+          const __m128d quotient = _mm_mul_pd(elapsed, _mm_loadu_pd(inversePeriod + i));
+
+          __m128d whole = _mm_sub_pd(_mm_add_pd(quotient, magic), magic);
+          whole = _mm_sub_pd(whole, _mm_and_pd(_mm_cmpgt_pd(whole, quotient), one));
+
+          __m128d local = _mm_sub_pd(elapsed, _mm_mul_pd(whole, p));
+          local = _mm_add_pd(local, _mm_and_pd(_mm_cmplt_pd(local, zero), p));
+          local = _mm_sub_pd(local, _mm_and_pd(_mm_cmpge_pd(local, p), p));
+
+          const __m128d fading = _mm_sub_pd(local, _mm_loadu_pd(sleep + i));
+          const __m128d value = _mm_min_pd(fading, _mm_sub_pd(_mm_add_pd(f, f), fading));
+
+          const __m128d valid = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(elapsed, zero), _mm_cmpge_pd(fading, zero)),
+            _mm_cmpgt_pd(f, zero));
+
+          const __m128d alpha = _mm_and_pd(_mm_div_pd(value, _mm_max_pd(f, one)), valid);
+          _mm_storel_pi((__m64 *)(alphas + i), _mm_cvtpd_ps(alpha));
+        }
+
+        return i;
+      }
+    #endif
+
+    #if _d_compositor_avx2
+      _d_target_avx2 uint32 EvaluateAvx2(float64 t)
+      {
+        const __m256d time = _mm256_set1_pd(t);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d one = _mm256_set1_pd(1.0);
+
+        uint32 i = 0;
+        for(; i + 4 <= count; i += 4)
+        {
+          const __m256d p = _mm256_loadu_pd(period + i);
+          const __m256d f = _mm256_loadu_pd(fade + i);
+
+          const __m256d elapsed = _mm256_sub_pd(time, _mm256_loadu_pd(phase + i));
+          const __m256d whole = _mm256_floor_pd(_mm256_mul_pd(elapsed, _mm256_loadu_pd(inversePeriod + i)));
+
+          __m256d local = _mm256_sub_pd(elapsed, _mm256_mul_pd(whole, p));
+          local = _mm256_add_pd(local, _mm256_and_pd(_mm256_cmp_pd(local, zero, _CMP_LT_OQ), p));
+          local = _mm256_sub_pd(local, _mm256_and_pd(_mm256_cmp_pd(local, p, _CMP_GE_OQ), p));
+
+          const __m256d fading = _mm256_sub_pd(local, _mm256_loadu_pd(sleep + i));
+          const __m256d value = _mm256_min_pd(fading, _mm256_sub_pd(_mm256_add_pd(f, f), fading));
+
+          const __m256d valid = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(elapsed, zero, _CMP_GE_OQ),
+            _mm256_cmp_pd(fading, zero, _CMP_GE_OQ)), _mm256_cmp_pd(f, zero, _CMP_GT_OQ));
+
+          const __m256d alpha = _mm256_and_pd(_mm256_div_pd(value, _mm256_max_pd(f, one)), valid);
+          _mm_storeu_ps(alphas + i, _mm256_cvtpd_ps(alpha));
+        }
+
+        return i;
+      }
+    #endif
+};
+
+//
+//
+//
+// Runs tasks 0..count-1 of a job on a fixed set of threads. Each worker starts with a contiguous
+// range and steals single tasks from the far end of other ranges once its own is empty.
+class WorkStealingPool
+{
+  public:
+    class Job
+    {
+      public:
+        virtual ~Job()
+        {
+          ;
+        }
+
+        // Called concurrently from every worker, once per task.
+        virtual void Execute(uint32 task) = 0;
+    };
+
+    // The calling thread is worker 0, so THREAD_COUNT - 1 threads are started.
+    const uint32 THREAD_COUNT;
+
+    WorkStealingPool(uint32 threadCount)
+      : THREAD_COUNT(threadCount ? threadCount : 1)
+    {
+      mutex = SDL_CreateMutex();
+      startCond = SDL_CreateCond();
+      doneCond = SDL_CreateCond();
+      if(!mutex || !startCond || !doneCond)
+        _d_log_fatal("WorkStealingPool: " << SDL_GetError());
+
+      job = null;
+      generation = 0;
+      remaining = 0;
+      quit = false;
+
+      queues = new Queue[THREAD_COUNT];
+      for(uint32 i = 0; i < THREAD_COUNT; i++)
+      {
+        queues[i].mutex = SDL_CreateMutex();
+        if(!queues[i].mutex)
+          _d_log_fatal("WorkStealingPool: " << SDL_GetError());
+
+        queues[i].head = 0;
+        queues[i].tail = 0;
+      }
+
+      workers = new Worker[THREAD_COUNT];
+      for(uint32 i = 1; i < THREAD_COUNT; i++)
+      {
+        workers[i].pool = this;
+        workers[i].index = i;
+        workers[i].thread = SDL_CreateThread(WorkerMain, &workers[i]);
+        if(!workers[i].thread)
+          _d_log_fatal("WorkStealingPool: failed to start a thread: " << SDL_GetError());
+      }
+    }
+
+    ~WorkStealingPool()
+    {
+      SDL_LockMutex(mutex);
+      quit = true;
+      SDL_CondBroadcast(startCond);
+      SDL_UnlockMutex(mutex);
+
+      for(uint32 i = 1; i < THREAD_COUNT; i++)
+        SDL_WaitThread(workers[i].thread, null);
+
+      for(uint32 i = 0; i < THREAD_COUNT; i++)
+        SDL_DestroyMutex(queues[i].mutex);
+
+      delete[] workers;
+      delete[] queues;
+
+      SDL_DestroyCond(doneCond);
+      SDL_DestroyCond(startCond);
+      SDL_DestroyMutex(mutex);
+    }
+
+    // Returns once every task has been executed.
+    void Run(Job &job, uint32 count)
+    {
+      Start(job, count);
+      Wait();
+    }
+
+    // Hands the tasks to the worker threads and returns, the caller may do other work until Wait().
+    void Start(Job &job, uint32 count)
+    {
+      SDL_LockMutex(mutex);
+
+      this->job = &job;
+
+      for(uint32 i = 0; i < THREAD_COUNT; i++)
+      {
+        SDL_LockMutex(queues[i].mutex);
+        queues[i].head = (uint32)((uint64)count * i / THREAD_COUNT);
+        queues[i].tail = (uint32)((uint64)count * (i + 1) / THREAD_COUNT);
+        SDL_UnlockMutex(queues[i].mutex);
+      }
+
+      remaining = count;
+      generation++;
+
+      SDL_CondBroadcast(startCond);
+      SDL_UnlockMutex(mutex);
+    }
+
+    // Helps with whatever is left, then blocks until every task has been executed.
+    void Wait()
+    {
+      Work(0);
+
+      SDL_LockMutex(mutex);
+      while(remaining)
+        SDL_CondWait(doneCond, mutex);
+      this->job = null;
+      SDL_UnlockMutex(mutex);
+    }
+
+  private:
+    // Tasks head..tail-1, the owner takes from the head, thieves from the tail.
+    struct Queue
+    {
+      SDL_mutex *mutex;
+      uint32 head;
+      uint32 tail;
+    };
+
+    struct Worker
+    {
+      WorkStealingPool *pool;
+      uint32 index;
+      SDL_Thread *thread;
+    };
+
+    SDL_mutex *mutex;
+    SDL_cond *startCond;
+    SDL_cond *doneCond;
+
+    // Guarded by mutex.
+    Job *job;
+    uint32 generation;
+    uint32 remaining;
+    bool quit;
+
+    Queue *queues;
+    Worker *workers;
+
+    static int WorkerMain(void *data)
+    {
+      Worker &worker = *(Worker *)data;
+      WorkStealingPool &pool = *worker.pool;
+      uint32 seen = 0;
+
+      forever
+      {
+        SDL_LockMutex(pool.mutex);
+        while(pool.generation == seen && !pool.quit)
+          SDL_CondWait(pool.startCond, pool.mutex);
+
+        if(pool.quit)
+        {
+          SDL_UnlockMutex(pool.mutex);
+          return 0;
+        }
+
+        seen = pool.generation;
+        SDL_UnlockMutex(pool.mutex);
+
+        pool.Work(worker.index);
+      }
+    }
+
+    // Tasks are only handed out while Run() waits, so job stays valid for any task taken here.
+    void Work(uint32 index)
+    {
+      uint32 done = 0;
+      uint32 task;
+
+      while(Pop(index, task) || Steal(index, task))
+      {
+        job->Execute(task);
+        done++;
+      }
+
+      if(!done)
+        return;
+
+      SDL_LockMutex(mutex);
+      remaining -= done;
+      if(!remaining)
+        SDL_CondSignal(doneCond);
+      SDL_UnlockMutex(mutex);
+    }
+
+    bool Pop(uint32 index, uint32 &task)
+    {
+      Queue &queue = queues[index];
+      bool found = false;
+
+      SDL_LockMutex(queue.mutex);
+      if(queue.head < queue.tail)
+      {
+        task = queue.head++;
+        found = true;
+      }
+      SDL_UnlockMutex(queue.mutex);
+
+      return found;
+    }
+
+    bool Steal(uint32 index, uint32 &task)
+    {
+      for(uint32 i = 1; i < THREAD_COUNT; i++)
+      {
+        Queue &queue = queues[(index + i) % THREAD_COUNT];
+        bool found = false;
+
+        SDL_LockMutex(queue.mutex);
+        if(queue.head < queue.tail)
+        {
+          task = --queue.tail;
+          found = true;
+        }
+        SDL_UnlockMutex(queue.mutex);
+
+        if(found)
+          return true;
+      }
+
+      return false;
+    }
+};
+
+//
+//
+//
+// Draws are recorded and binned to the screen tiles they touch. At End() every non-empty tile
+// replays its draws in submission order on the pool, so the result does not depend on the number
+// of threads.
+class CpuRenderer : public Renderer, private WorkStealingPool::Job
+{
+  public:
+    const uint32 WIDTH;
+    const uint32 HEIGHT;
+
+    // threadCount 0 uses every core.
+    CpuRenderer(uint32 width, uint32 height, uint32 threadCount)
+      : WIDTH(width), HEIGHT(height)
+    {
+      // SDL emulates 32 bits with a shadow surface when the display differs.
+      screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_SWSURFACE);
+      if(!screen)
+        _d_log_fatal("Failed to initialize video: " << SDL_GetError());
+
+      Init(threadCount);
+    }
+
+    // Draws into a 32-bit surface owned by the caller, Present() does nothing.
+    CpuRenderer(SDL_Surface *target, uint32 threadCount)
+      : WIDTH(target->w), HEIGHT(target->h)
+    {
+      screen = target;
+
+      Init(threadCount);
+    }
+
+    ~CpuRenderer()
+    {
+      delete pool;
+
+      delete[] commands;
+      delete[] tileStart;
+      delete[] tileFill;
+      delete[] activeTiles;
+      delete[] bins;
+    }
+
+    const GlCaps* GetGlCaps() const
+    {
+      return null;
+    }
+
+    // SDL_UpdateRects() copies from the surface, which keeps the previous frame.
+    uint32 GetBufferAge() const
+    {
+      return 1;
+    }
+
+    GLint GetTextureSize(GLint n) const
+    {
+      return n;
+    }
+
+    GLint GetMaxTextureSize() const
+    {
+      return _d_cpu_renderer_max_texture_size;
+    }
+
+    // Always 32 bits, the kernels read one texel layout.
+    TexturePage* CreatePage(SDL_Surface *surface, TextureFormat::Type)
+    {
+      SDL_Surface *rgba = ConvertToRgba(surface);
+      uint32 *pixels = new uint32[rgba->w * rgba->h];
+
+      for(GLint y = 0; y < rgba->h; y++)
+      {
+        const uint32 *row = (const uint32 *)((const byte *)rgba->pixels + y * rgba->pitch);
+
+        for(GLint x = 0; x < rgba->w; x++)
+          pixels[y * rgba->w + x] = Pack(row[x] & 0xff, (row[x] >> 8) & 0xff, (row[x] >> 16) & 0xff, row[x] >> 24);
+      }
+
+      TexturePage *page = new TexturePage(pixels, rgba->w, rgba->h);
+      SDL_FreeSurface(rgba);
+
+      return page;
+    }
+
+    TexturePage* CreateEmptyPage(GLint width, GLint height, TextureFormat::Type)
+    {
+      uint32 *pixels = new uint32[width * height];
+      memset(pixels, 0, width * height * sizeof(uint32));
+
+      return new TexturePage(pixels, width, height);
+    }
+
+    void UpdatePage(TexturePage &page, const SDL_Surface *rgba, GLint y, GLint rows)
+    {
+      for(GLint r = y; r < y + rows; r++)
+      {
+        const uint32 *row = (const uint32 *)((const byte *)rgba->pixels + r * rgba->pitch);
+        uint32 *dest = page.PIXELS + r * page.WIDTH;
+
+        for(GLint x = 0; x < rgba->w; x++)
+          dest[x] = Pack(row[x] & 0xff, (row[x] >> 8) & 0xff, (row[x] >> 16) & 0xff, row[x] >> 24);
+      }
+    }
+
+    // Texels live in system memory with everything else, there is nothing to save.
+    bool ReleasePage(TexturePage &)
+    {
+      return false;
+    }
+
+    void RestorePage(TexturePage &page, const SDL_Surface *rgba)
+    {
+      UpdatePage(page, rgba, 0, rgba->h);
+    }
+
+    void Begin()
+    {
+      if(SDL_MUSTLOCK(screen))
+        SDL_LockSurface(screen);
+
+      drawCalls = 0;
+      tint = 0xffffffff;
+    }
+
+    void End()
+    {
+      Flush();
+
+      if(SDL_MUSTLOCK(screen))
+        SDL_UnlockSurface(screen);
+
+      frameDrawCalls = drawCalls;
+    }
+
+    void SetClip(const Rect *rect)
+    {
+      clip = Rect(0, 0, WIDTH, HEIGHT);
+      if(rect)
+        clip.Intersect(*rect);
+    }
+
+    void Clear()
+    {
+      if(!clip.IsEmpty())
+        AddCommand(clip, null, 0);
+    }
+
+    void SetColor(float64 r, float64 g, float64 b, float64 a)
+    {
+      tint = Pack((uint32)(r * 255.0 + 0.5), (uint32)(g * 255.0 + 0.5), (uint32)(b * 255.0 + 0.5), (uint32)(a * 255.0 + 0.5));
+    }
+
+    void SetProgram(const FragmentProgram *program)
+    {
+      if(program)
+        _d_log_fatal("CpuRenderer: fragment programs are not supported.");
+    }
+
+    void Draw(const Texture &texture, GLdouble x, GLdouble y)
+    {
+      Draw(texture, x, y, Rect(0, 0, texture.WIDTH, texture.HEIGHT));
+    }
+
+    // Sprites are drawn 1:1, a pixel is covered when its center is, as with GL_NEAREST.
+    void Draw(const Texture &texture, GLdouble x, GLdouble y, const Rect &part)
+    {
+      Rect dest((GLint)::ceil(x + texture.trimX + part.x - 0.5), (GLint)::ceil(y + texture.trimY + part.y - 0.5),
+        part.width, part.height);
+      const GLint left = dest.x;
+      const GLint top = dest.y;
+
+      dest.Intersect(clip);
+      if(dest.IsEmpty())
+        return;
+
+      const TexturePage &page = texture.page;
+      AddCommand(dest, page.PIXELS + (texture.Y + part.y + dest.y - top) * page.WIDTH + texture.X + part.x + dest.x - left,
+        page.WIDTH);
+
+      drawCalls++;
+    }
+
+    void Present(const DamageRegion &region, bool fullRedraw)
+    {
+      // Offscreen targets have nothing to show.
+      if(screen != SDL_GetVideoSurface())
+        return;
+
+      if(fullRedraw)
+      {
+        SDL_UpdateRect(screen, 0, 0, 0, 0);
+        return;
+      }
+
+      SDL_Rect rects[_d_damage_max_rects];
+      for(uint32 i = 0; i < region.GetCount(); i++)
+      {
+        const Rect &r = region.Get(i);
+
+        rects[i].x = (Sint16)r.x;
+        rects[i].y = (Sint16)r.y;
+        rects[i].w = (Uint16)r.width;
+        rects[i].h = (Uint16)r.height;
+      }
+
+      SDL_UpdateRects(screen, region.GetCount(), rects);
+    }
+
+    void ReadPixels(byte *rgb) const
+    {
+      if(SDL_MUSTLOCK(screen))
+        SDL_LockSurface(screen);
+
+      for(uint32 y = 0; y < HEIGHT; y++)
+      {
+        const uint32 *row = GetRow(y);
+
+        for(uint32 x = 0; x < WIDTH; x++, rgb += 3)
+        {
+          rgb[0] = (byte)(row[x] >> rShift);
+          rgb[1] = (byte)(row[x] >> gShift);
+          rgb[2] = (byte)(row[x] >> bShift);
+        }
+      }
+
+      if(SDL_MUSTLOCK(screen))
+        SDL_UnlockSurface(screen);
+    }
+
+    uint32 GetDrawCalls() const
+    {
+      return frameDrawCalls;
+    }
+
+    uint32 GetThreadCount() const
+    {
+      return pool->THREAD_COUNT;
+    }
+
+  private:
+    // A clear when src is null, otherwise src points at the texel for the top left of rect.
+    struct Command
+    {
+      Rect rect;
+      const uint32 *src;
+      GLint pitch;
+      uint32 tint;
+    };
+
+    SDL_Surface *screen;
+
+    uint32 rShift;
+    uint32 gShift;
+    uint32 bShift;
+    uint32 aShift;
+
+    BlendSpanFunc blend;
+
+    Rect clip;
+    uint32 tint;
+
+    uint32 drawCalls;
+    uint32 frameDrawCalls;
+
+    WorkStealingPool *pool;
+
+    Command *commands;
+    uint32 commandCount;
+
+    uint32 tilesX;
+    uint32 tilesY;
+
+    // Commands touching tile t are bins[tileStart[t]] to bins[tileStart[t + 1] - 1].
+    uint32 *tileStart;
+    uint32 *tileFill;
+    uint32 *activeTiles;
+    uint32 activeTileCount;
+
+    uint32 *bins;
+    uint32 binCapacity;
+
+    void Init(uint32 threadCount)
+    {
+      const SDL_PixelFormat *format = screen->format;
+      if(format->BytesPerPixel != 4)
+        _d_log_fatal("CpuRenderer: 32-bit surface required, got " << format->BitsPerPixel);
+
+      // Alpha lives in whichever byte the framebuffer does not use for color.
+      const uint32 unused = ~(format->Rmask | format->Gmask | format->Bmask);
+
+      rShift = format->Rshift;
+      gShift = format->Gshift;
+      bShift = format->Bshift;
+      aShift = unused & 0xff ? 0 : unused & 0xff00 ? 8 : unused & 0xff0000 ? 16 : 24;
+
+      const char *kernel = "";
+      switch(aShift)
+      {
+        case 0: blend = SelectBlendSpan<0>(kernel); break;
+        case 8: blend = SelectBlendSpan<1>(kernel); break;
+        case 16: blend = SelectBlendSpan<2>(kernel); break;
+        default: blend = SelectBlendSpan<3>(kernel); break;
+      }
+
+      clip = Rect(0, 0, WIDTH, HEIGHT);
+      tint = 0xffffffff;
+
+      drawCalls = 0;
+      frameDrawCalls = 0;
+
+      //
+      pool = new WorkStealingPool(threadCount ? threadCount : CpuFeatures::GetCoreCount());
+
+      commands = new Command[_d_cpu_renderer_max_commands];
+      commandCount = 0;
+
+      tilesX = (WIDTH + _d_cpu_renderer_tile_size - 1) / _d_cpu_renderer_tile_size;
+      tilesY = (HEIGHT + _d_cpu_renderer_tile_size - 1) / _d_cpu_renderer_tile_size;
+
+      tileStart = new uint32[tilesX * tilesY + 1];
+      tileFill = new uint32[tilesX * tilesY];
+      activeTiles = new uint32[tilesX * tilesY];
+      activeTileCount = 0;
+
+      binCapacity = _d_cpu_renderer_max_commands;
+      bins = new uint32[binCapacity];
+
+      _d_log_info("CpuRenderer: " << WIDTH << "*" << HEIGHT << ", " << kernel << " kernels, "
+        << pool->THREAD_COUNT << " threads, " << tilesX << "*" << tilesY << " tiles");
+    }
+
+    void AddCommand(const Rect &rect, const uint32 *src, GLint pitch)
+    {
+      if(commandCount == _d_cpu_renderer_max_commands)
+        Flush();
+
+      Command &command = commands[commandCount++];
+      command.rect = rect;
+      command.src = src;
+      command.pitch = pitch;
+      command.tint = tint;
+    }
+
+    // Bins with a counting sort, which keeps submission order within each tile.
+    void Flush()
+    {
+      if(!commandCount)
+        return;
+
+      const uint32 tileCount = tilesX * tilesY;
+      memset(tileStart, 0, (tileCount + 1) * sizeof(uint32));
+
+      for(uint32 c = 0; c < commandCount; c++)
+      {
+        const Rect &r = commands[c].rect;
+
+        for(uint32 ty = r.y / _d_cpu_renderer_tile_size; ty <= (uint32)(r.y + r.height - 1) / _d_cpu_renderer_tile_size; ty++)
+          for(uint32 tx = r.x / _d_cpu_renderer_tile_size; tx <= (uint32)(r.x + r.width - 1) / _d_cpu_renderer_tile_size; tx++)
+            tileStart[ty * tilesX + tx + 1]++;
+      }
+
+      activeTileCount = 0;
+      for(uint32 t = 0; t < tileCount; t++)
+      {
+        if(tileStart[t + 1])
+          activeTiles[activeTileCount++] = t;
+
+        tileStart[t + 1] += tileStart[t];
+        tileFill[t] = tileStart[t];
+      }
+
+      if(tileStart[tileCount] > binCapacity)
+      {
+        delete[] bins;
+        binCapacity = tileStart[tileCount] * 2;
+        bins = new uint32[binCapacity];
+      }
+
+      for(uint32 c = 0; c < commandCount; c++)
+      {
+        const Rect &r = commands[c].rect;
+
+        for(uint32 ty = r.y / _d_cpu_renderer_tile_size; ty <= (uint32)(r.y + r.height - 1) / _d_cpu_renderer_tile_size; ty++)
+          for(uint32 tx = r.x / _d_cpu_renderer_tile_size; tx <= (uint32)(r.x + r.width - 1) / _d_cpu_renderer_tile_size; tx++)
+            bins[tileFill[ty * tilesX + tx]++] = c;
+      }
+
+      //
+      pool->Run(*this, activeTileCount);
+
+      commandCount = 0;
+    }
+
+    // Renders one tile, tiles never overlap so no locking is needed.
+    void Execute(uint32 task)
+    {
+      const uint32 t = activeTiles[task];
+      const Rect tile(
+        (t % tilesX) * _d_cpu_renderer_tile_size, (t / tilesX) * _d_cpu_renderer_tile_size,
+        _d_cpu_renderer_tile_size, _d_cpu_renderer_tile_size);
+
+      for(uint32 i = tileStart[t]; i < tileStart[t + 1]; i++)
+      {
+        const Command &command = commands[bins[i]];
+
+        Rect r = command.rect;
+        r.Intersect(tile);
+
+        if(!command.src)
+        {
+          for(GLint y = r.y; y < r.y + r.height; y++)
+            memset(GetRow(y) + r.x, 0, r.width * sizeof(uint32));
+
+          continue;
+        }
+
+        const uint32 *src = command.src + (r.y - command.rect.y) * command.pitch + r.x - command.rect.x;
+        for(GLint row = 0; row < r.height; row++)
+          blend(GetRow(r.y + row) + r.x, src + row * command.pitch, r.width, command.tint);
+      }
+    }
+
+    uint32 Pack(uint32 r, uint32 g, uint32 b, uint32 a) const
+    {
+      return (r << rShift) | (g << gShift) | (b << bShift) | (a << aShift);
+    }
+
+    uint32* GetRow(GLint y) const
+    {
+      return (uint32 *)((byte *)screen->pixels + y * screen->pitch);
+    }
+};
+
+//
+//
+//
+// --bench-raster: composites a synthetic scene shaped like the real one (an opaque backdrop, sparse
+// light masks, a translucent overlay) with 1 to N threads and checks every run yields the same frame.
+class RasterBench
+{
+  public:
+    static void Run(uint32 maxThreads)
+    {
+      static const uint32 SIZES[][2] = {{800, 600}, {1920, 1080}, {3840, 2160}};
+
+      if(!maxThreads)
+        maxThreads = CpuFeatures::GetCoreCount();
+
+      for(uint32 s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++)
+      {
+        const uint32 width = SIZES[s][0];
+        const uint32 height = SIZES[s][1];
+
+        SDL_Surface *target = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+        if(!target)
+          _d_log_fatal(_d_file_line << ": " << SDL_GetError());
+
+        // Pages are plain texel arrays, any renderer with the same target format can draw them.
+        TexturePage *pages[3];
+        Texture *textures[3];
+        {
+          CpuRenderer renderer(target, 1);
+          MakeTextures(renderer, pages, textures);
+        }
+
+        float64 baseTime = 0;
+        uint32 baseChecksum = 0;
+
+        for(uint32 threads = 1; threads <= maxThreads; threads++)
+        {
+          CpuRenderer renderer(target, threads);
+
+          // Warm up.
+          DrawScene(renderer, textures);
+
+          const uint32 start = SDL_GetTicks();
+          for(uint32 f = 0; f < _d_bench_raster_frames; f++)
+            DrawScene(renderer, textures);
+          const uint32 elapsed = SDL_GetTicks() - start;
+
+          const float64 time = (float64)(elapsed ? elapsed : 1) / _d_bench_raster_frames;
+          const uint32 checksum = GetChecksum(target);
+
+          if(threads == 1)
+          {
+            baseTime = time;
+            baseChecksum = checksum;
+          }
+
+          _d_log_info("Raster: " << width << "*" << height << ", " << threads << " threads: "
+            << time << " ms/frame, " << baseTime / time << "x");
+
+          if(checksum != baseChecksum)
+            _d_log_err("Raster: " << threads << " threads produced a different frame than 1 thread.");
+        }
+
+        for(uint32 i = 0; i < 3; i++)
+        {
+          delete textures[i];
+          delete pages[i];
+        }
+
+        SDL_FreeSurface(target);
+      }
+    }
+
+  private:
+    static void MakeTextures(Renderer &renderer, TexturePage **pages, Texture **textures)
+    {
+      static const GLint SIZES[][2] = {{256, 256}, {256, 256}, {512, 128}};
+
+      for(uint32 i = 0; i < 3; i++)
+      {
+        SDL_Surface *surface = CreateRgbaSurface(SIZES[i][0], SIZES[i][1]);
+
+        for(GLint y = 0; y < surface->h; y++)
+        {
+          uint32 *row = (uint32 *)((byte *)surface->pixels + y * surface->pitch);
+
+          for(GLint x = 0; x < surface->w; x++)
+          {
+            if(i == 0)
+              row[x] = x | (y << 8) | ((x ^ y) & 0xff) << 16 | 0xff000000;
+            elif(i == 1)
+              row[x] = x % 16 < 3 && y % 16 < 3 ? 0xffffffff : 0;
+            else
+              row[x] = (x / 2) * 0x01010101;
+          }
+        }
+
+        pages[i] = renderer.CreatePage(surface, TextureFormat::Rgba8);
+        textures[i] = new Texture(*pages[i], 0, 0, surface->w, surface->h);
+
+        SDL_FreeSurface(surface);
+      }
+    }
+
+    static void DrawScene(CpuRenderer &renderer, Texture **textures)
+    {
+      renderer.Begin();
+      renderer.SetClip(null);
+      renderer.Clear();
+
+      for(uint32 layer = 0; layer < 3; layer++)
+      {
+        const Texture &texture = *textures[layer];
+
+        if(layer == 0)
+          renderer.SetColor(1, 1, 1, 1);
+        elif(layer == 1)
+          renderer.SetColor(1, 0.055, 0.055, 1);
+        else
+          renderer.SetColor(0.5, 0.5, 0.5, 0.5);
+
+        for(uint32 y = 0; y < renderer.HEIGHT; y += texture.HEIGHT * (layer == 2 ? 3 : 1))
+          for(uint32 x = 0; x < renderer.WIDTH; x += texture.WIDTH + (layer == 2 ? 128 : 0))
+            renderer.Draw(texture, x, y);
+      }
+
+      renderer.End();
+    }
+
+    // FNV-1a over the visible pixels.
+    static uint32 GetChecksum(SDL_Surface *surface)
+    {
+      uint32 hash = 2166136261u;
+
+      for(GLint y = 0; y < surface->h; y++)
+      {
+        const byte *row = (const byte *)surface->pixels + y * surface->pitch;
+
+        for(GLint i = 0; i < surface->w * 4; i++)
+          hash = (hash ^ row[i]) * 16777619u;
+      }
+
+      return hash;
+    }
+};
+
+//
+//
+//
+// --bench-scale: one view-sized scene drawn into a window of another size the three App::ScaleMode
+// ways, in that order. Swaps are not synchronized to the display.
+class ScaleBench
+{
+  public:
+    static void Run(uint32 width, uint32 height)
+    {
+      static const char *MODES[] = {"native", "target", "assets"};
+
+      const uint32 viewWidth = _d_app_view_width;
+      const uint32 viewHeight = _d_app_view_height;
+      const GLdouble scale = GlRenderer::GetViewScale(width, height, viewWidth, viewHeight);
+
+      SDL_Surface *images[3];
+      MakeImages(images, viewWidth, viewHeight);
+
+      // What ImageCache does on a miss.
+      SDL_Surface *scaled[3];
+      const uint64 start = TimeMgr::GetPerfMicros();
+      for(uint32 i = 0; i < 3; i++)
+        scaled[i] = ScaleRgba(images[i], (GLint)(images[i]->w * scale + 0.5), (GLint)(images[i]->h * scale + 0.5));
+
+      _d_log_info("Scale: " << width << "*" << height << ", view scale " << scale << ", resampling took "
+        << (float64)(TimeMgr::GetPerfMicros() - start) / 1000.0 << " ms");
+
+      SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, 0);
+
+      float64 baseTime = 0;
+
+      for(uint32 mode = 0; mode < 3; mode++)
+      {
+        GlRenderer *renderer = new GlRenderer(width, height, viewWidth, viewHeight, mode == 1);
+
+        TexturePage *pages[3];
+        Texture *textures[3];
+        for(uint32 i = 0; i < 3; i++)
+        {
+          SDL_Surface *surface = mode == 2 ? scaled[i] : images[i];
+
+          pages[i] = renderer->CreatePage(surface, TextureFormat::Rgba8);
+          textures[i] = new Texture(*pages[i], 0, 0, surface->w, surface->h);
+          textures[i]->scale = (GLdouble)surface->w / (GLdouble)images[i]->w;
+        }
+
+        // Warm up.
+        DrawScene(*renderer, textures);
+        glFinish();
+
+        const uint64 frameStart = TimeMgr::GetPerfMicros();
+        for(uint32 f = 0; f < _d_bench_scale_frames; f++)
+          DrawScene(*renderer, textures);
+        glFinish();
+
+        const float64 time = (float64)(TimeMgr::GetPerfMicros() - frameStart) / 1000.0 / _d_bench_scale_frames;
+        if(!mode)
+          baseTime = time;
+
+        _d_log_info("Scale: " << MODES[mode] << ": " << time << " ms/frame, " << baseTime / time << "x native");
+
+        for(uint32 i = 0; i < 3; i++)
+        {
+          delete textures[i];
+          delete pages[i];
+        }
+
+        delete renderer;
+      }
+
+      for(uint32 i = 0; i < 3; i++)
+      {
+        SDL_FreeSurface(scaled[i]);
+        SDL_FreeSurface(images[i]);
+      }
+    }
+
+  private:
+    // A background, a full-view light mask and a small sprite, like the App's.
+    static void MakeImages(SDL_Surface **images, uint32 viewWidth, uint32 viewHeight)
+    {
+      images[0] = CreateRgbaSurface(viewWidth, viewHeight);
+      images[1] = CreateRgbaSurface(viewWidth, viewHeight);
+      images[2] = CreateRgbaSurface(32, 20);
+
+      for(uint32 i = 0; i < 3; i++)
+      {
+        SDL_Surface *surface = images[i];
+
+        for(GLint y = 0; y < surface->h; y++)
+        {
+          uint32 *row = (uint32 *)((byte *)surface->pixels + y * surface->pitch);
+
+          for(GLint x = 0; x < surface->w; x++)
+          {
+            if(i == 0)
+              row[x] = (x & 0xff) | (y & 0xff) << 8 | ((x ^ y) & 0xff) << 16 | 0xff000000;
+            elif(i == 1)
+              row[x] = x % 24 < 2 && y % 16 < 2 ? 0xffffffff : 0x00ffffff;
+            else
+              row[x] = (x + y) % 3 ? 0xff40c0ff : 0;
+          }
+        }
+      }
+    }
+
+    static void DrawScene(GlRenderer &renderer, Texture **textures)
+    {
+      renderer.Begin();
+      renderer.SetClip(null);
+      renderer.Clear();
+
+      renderer.SetColor(1, 1, 1, 1);
+      renderer.Draw(*textures[0], 0, 0);
+
+      renderer.SetColor(0.75, 0.6375, 0.3, 0.75);
+      renderer.Draw(*textures[1], 0, 0);
+
+      renderer.SetColor(1, 1, 1, 1);
+      for(uint32 i = 0; i < 64; i++)
+        renderer.Draw(*textures[2], (i * 97) % renderer.VIEW_WIDTH, (i * 61) % renderer.VIEW_HEIGHT);
+
+      renderer.End();
+      renderer.Present(DamageRegion(), true);
+    }
+};
+
+//
+//
+//
+// --check-texture-budget: the "now playing" badge and a light take turns over the background, three
+// frames each, under a budget that fits only one of them next to it. As App::Run() does, only what
+// is drawn is used, so the hidden page must be released, and must come back with the same texels.
+// Then the airplane with packed lights, whose separate masks are never drawn and must stay released.
+class TextureBudgetCheck
+{
+  public:
+    // False if a hidden page stays resident or a shown one is not restored.
+    static bool Run()
+    {
+      GlRenderer renderer(256, 256, 256, 256, false);
+
+      const bool turns = CheckTurns(renderer);
+      const bool packed = CheckPackedLights(renderer);
+
+      return turns && packed;
+    }
+
+  private:
+    static bool CheckTurns(Renderer &renderer)
+    {
+      static const GLint SIZES[][2] = {{256, 256}, {128, 64}, {128, 64}};
+      static const char *const NAMES[] = {"background", "badge", "light"};
+      const uint32 FRAMES = 12;
+
+      SDL_Surface *surfaces[3];
+      TexturePage *pages[3];
+      for(uint32 i = 0; i < 3; i++)
+      {
+        surfaces[i] = MakeSurface(SIZES[i][0], SIZES[i][1], i);
+        pages[i] = renderer.CreatePage(surfaces[i], TextureFormat::Rgba8);
+      }
+
+      TextureManager textures(renderer, pages[0]->GetBytes() + pages[1]->GetBytes());
+
+      Texture *sprites[3];
+      for(uint32 i = 0; i < 3; i++)
+      {
+        textures.AddPage(pages[i], surfaces[i]);
+        sprites[i] = textures.AddTexture(new Texture(*pages[i], 0, 0, SIZES[i][0], SIZES[i][1]));
+      }
+
+      //
+      bool ok = true;
+
+      for(uint32 f = 0; f < FRAMES; f++)
+      {
+        const uint32 shown = (f / 3) % 2 ? 2 : 1;
+        const uint32 hidden = 3 - shown;
+        const TextureManager::Stats before = textures.GetStats();
+
+        textures.BeginFrame();
+        textures.Use(*sprites[0]);
+        const bool resident = textures.Use(*sprites[shown]);
+        textures.Trim();
+
+        const TextureManager::Stats &after = textures.GetStats();
+
+        if(!resident || !HasTexels(*pages[shown], surfaces[shown]))
+        {
+          _d_log_err("Texture budget check: frame " << f << ", the shown " << NAMES[shown] << " page is not restored");
+          ok = false;
+        }
+
+        if(pages[hidden]->residentRows)
+        {
+          _d_log_err("Texture budget check: frame " << f << ", the hidden " << NAMES[hidden] << " page is still resident");
+          ok = false;
+        }
+
+        // Each turn reloads the shown page and releases the other one.
+        const uint32 swaps = f && !(f % 3) ? 1 : 0;
+        if(f && (after.misses - before.misses != swaps || after.evictions - before.evictions != swaps))
+        {
+          _d_log_err("Texture budget check: frame " << f << ", " << after.misses - before.misses << " reloads and "
+            << after.evictions - before.evictions << " evictions, expected " << swaps);
+          ok = false;
+        }
+      }
+
+      const TextureManager::Stats &stats = textures.GetStats();
+      _d_log_info("Texture budget check: " << FRAMES << " frames, " << stats.evictions << " evictions, "
+        << stats.misses << " reloads, " << stats.residentBytes / 1024 << " KB resident of a "
+        << textures.BUDGET / 1024 << " KB budget");
+
+      for(uint32 i = 0; i < 3; i++)
+        SDL_FreeSurface(surfaces[i]);
+
+      return ok;
+    }
+
+    // As the optimized assets draw it: the packed lights are used while they are on, the red, green
+    // and white masks on their own pages never are.
+    static bool CheckPackedLights(Renderer &renderer)
+    {
+      static const char *const NAMES[] = {"airplane", "red mask", "green mask", "white mask", "packed lights"};
+      const uint32 FRAMES = 12;
+
+      SDL_Surface *surfaces[5];
+      TexturePage *pages[5];
+      for(uint32 i = 0; i < 5; i++)
+      {
+        surfaces[i] = MakeSurface(32, 32, i);
+        pages[i] = renderer.CreatePage(surfaces[i], TextureFormat::Rgba8);
+      }
+
+      TextureManager textures(renderer, pages[0]->GetBytes() + pages[4]->GetBytes());
+
+      Texture *sprites[5];
+      for(uint32 i = 0; i < 5; i++)
+      {
+        textures.AddPage(pages[i], surfaces[i]);
+        sprites[i] = textures.AddTexture(new Texture(*pages[i], 0, 0, 32, 32));
+      }
+
+      AirplaneEntity airplane(Line2d(), *sprites[0], *sprites[1], *sprites[2], *sprites[3], Fade());
+      airplane.lightsTexture = sprites[4];
+
+      //
+      bool ok = true;
+
+      for(uint32 f = 0; f < FRAMES; f++)
+      {
+        const bool lights = !((f / 3) % 2);
+
+        textures.BeginFrame();
+        const bool resident = airplane.Use(textures, lights);
+        textures.Trim();
+
+        if(!resident)
+        {
+          _d_log_err("Texture budget check: frame " << f << ", the airplane can not be drawn");
+          ok = false;
+        }
+
+        for(uint32 m = 1; m < 4; m++)
+          if(pages[m]->residentRows)
+          {
+            _d_log_err("Texture budget check: frame " << f << ", the " << NAMES[m] << " page is resident, it is never drawn");
+            ok = false;
+          }
+      }
+
+      // The masks are released once, nothing is reloaded.
+      const TextureManager::Stats &stats = textures.GetStats();
+      if(stats.evictions != 3 || stats.misses)
+      {
+        _d_log_err("Texture budget check: packed lights, " << stats.evictions << " evictions and " << stats.misses
+          << " reloads, expected 3 and 0");
+        ok = false;
+      }
+
+      _d_log_info("Texture budget check: packed lights, " << FRAMES << " frames, " << stats.evictions << " evictions, "
+        << stats.misses << " reloads, " << stats.residentBytes / 1024 << " KB resident of a "
+        << textures.BUDGET / 1024 << " KB budget");
+
+      for(uint32 i = 0; i < 5; i++)
+        SDL_FreeSurface(surfaces[i]);
+
+      return ok;
+    }
+
+    static SDL_Surface* MakeSurface(GLint width, GLint height, uint32 seed)
+    {
+      SDL_Surface *surface = CreateRgbaSurface(width, height);
+
+      for(GLint y = 0; y < height; y++)
+      {
+        uint32 *row = (uint32 *)((byte *)surface->pixels + y * surface->pitch);
+        for(GLint x = 0; x < width; x++)
+          row[x] = 0xff000000 | ((x * 7 + y * 13 + seed * 101) & 0xffffff);
+      }
+
+      return surface;
+    }
+
+    static bool HasTexels(const TexturePage &page, const SDL_Surface *rgba)
+    {
+      uint32 *texels = new uint32[page.WIDTH * page.HEIGHT];
+
+      glBindTexture(page.TARGET, page.TEXTURE);
+      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      glGetTexImage(page.TARGET, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+
+      bool same = true;
+      for(GLint y = 0; y < rgba->h && same; y++)
+        same = !memcmp(texels + y * page.WIDTH, (const byte *)rgba->pixels + y * rgba->pitch, rgba->w * 4);
+
+      delete[] texels;
+
+      return same;
+    }
+};
+
+//
+//
+//
+// --soak-fade: the scene's fades 1 hour, 1 day and 30 days in, plus a bit so no horizon falls on a
+// cycle boundary. Each value must match a reference that walks the cycles one by one instead of
+// taking Calc()'s remainder, bit for bit. The stepwise update Fade replaced, fed frame times of 15
+// to 17 ms, runs alongside for comparison.
+class FadeSoak
+{
+  public:
+    // False if any value differs.
+    static bool Run()
+    {
+      static const TimeMgr::Time HORIZONS[] = {3600u * 1000 + 1234, 24u * 3600 * 1000 + 1234, 30u * 24 * 3600 * 1000 + 1234};
+      static const char *const HORIZON_NAMES[] = {"1 hour", "1 day", "30 days"};
+
+      const Fade FADES[] =
+      {
+        Fade(_d_app_nc_lights_1_fade),
+        Fade(_d_app_airplane_lights_fade, _d_app_airplane_lights_sleep),
+        Fade(_d_app_np_fade, 0, _d_app_np_appear)
+      };
+      static const char *const FADE_NAMES[] = {"nc-lights1", "airplane-lights", "np"};
+
+      bool ok = true;
+
+      for(uint32 f = 0; f < sizeof(FADES) / sizeof(FADES[0]); f++)
+      {
+        const Fade &fade = FADES[f];
+
+        Stepwise stepwise;
+        TimeMgr::Time time = fade.PHASE;
+        uint32 seed = 1;
+
+        for(uint32 h = 0; h < sizeof(HORIZONS) / sizeof(HORIZONS[0]); h++)
+        {
+          while(time < HORIZONS[h])
+          {
+            seed = seed * 1664525 + 1013904223;
+
+            uint32 elapsed = 15 + (seed >> 16) % 3;
+            if(elapsed > HORIZONS[h] - time)
+              elapsed = (uint32)(HORIZONS[h] - time);
+
+            stepwise.Step(fade, elapsed);
+            time += elapsed;
+          }
+
+          const float64 value = fade.Calc(HORIZONS[h]);
+          const float64 expected = GetReference(fade, HORIZONS[h]);
+
+          if(value != expected || value < 0 || value > 1)
+          {
+            _d_log_err("Soak: " << FADE_NAMES[f] << " at " << HORIZON_NAMES[h] << ": " << value << ", expected " << expected);
+            ok = false;
+          }
+
+          _d_log_info("Soak: " << FADE_NAMES[f] << " at " << HORIZON_NAMES[h] << ": " << value
+            << ", stepwise " << stepwise.value << ", off by " << ::fabs(stepwise.value - value));
+        }
+      }
+
+      // Random fades as --bench-fades makes them, one in 16 of length 0. Those stay 0 and must never
+      // wake the scheduler, the rest must wake it later than now, before PHASE too.
+      {
+        const uint32 COUNT = 4096;
+        uint32 seed = 1;
+        uint32 constant = 0;
+        uint32 failures = 0;
+
+        for(uint32 i = 0; i < COUNT; i++)
+        {
+          seed = seed * 1664525 + 1013904223;
+          const uint32 fadeMillis = (seed >> 8) % 16 ? (seed >> 8) % 3000 + 1 : 0;
+          seed = seed * 1664525 + 1013904223;
+          const uint32 sleepMillis = (seed >> 8) % 4 ? (seed >> 8) % 5000 : 0;
+          seed = seed * 1664525 + 1013904223;
+          const TimeMgr::Time phase = (seed >> 8) % 2 ? (seed >> 8) % 10000 : 0;
+
+          const Fade fade(fadeMillis, sleepMillis, phase);
+          if(!fadeMillis)
+            constant++;
+
+          for(uint32 h = 0; h <= sizeof(HORIZONS) / sizeof(HORIZONS[0]); h++)
+          {
+            const TimeMgr::Time time = h ? HORIZONS[h - 1] : 0;
+            const TimeMgr::Time next = fade.GetNextChange(time);
+            const float64 value = fade.Calc(time);
+
+            if(fadeMillis ? next <= time || next == ~(TimeMgr::Time)0 || value < 0 || value > 1 : next != ~(TimeMgr::Time)0 || value != 0)
+              failures++;
+          }
+        }
+
+        if(failures)
+        {
+          _d_log_err("Soak: " << failures << " wrong next changes of " << COUNT << " random fades");
+          ok = false;
+        }
+
+        _d_log_info("Soak: " << COUNT << " random fades, " << constant << " of length 0, " << failures << " failures");
+      }
+
+      // Cost of one evaluation, at scattered times so nothing is hoisted.
+      {
+        const uint32 COUNT = 10000000;
+        const uint64 start = TimeMgr::GetPerfMicros();
+
+        float64 sum = 0;
+        for(uint32 i = 0; i < COUNT; i++)
+          sum += FADES[i % 3].Calc(i * 7919u);
+
+        const uint64 micros = TimeMgr::GetPerfMicros() - start;
+        _d_log_info("Soak: Fade::Calc() " << (float64)micros * 1000.0 / COUNT << " ns, checksum " << sum);
+      }
+
+      _d_log_info("Soak: " << (ok ? "passed" : "FAILED"));
+
+      return ok;
+    }
+
+  private:
+    // Whole cycles are stepped over one at a time, then the position in the last one is read as
+    // sleep, fade in and fade out.
+    static float64 GetReference(const Fade &fade, TimeMgr::Time time)
+    {
+      if(!fade.FADE_MILLIS || time < fade.PHASE)
+        return 0;
+
+      TimeMgr::Time start = fade.PHASE;
+      while(time - start >= fade.GetPeriod())
+        start += fade.GetPeriod();
+
+      const uint32 position = (uint32)(time - start);
+      if(position < fade.SLEEP_MILLIS)
+        return 0;
+
+      const uint32 fading = position - fade.SLEEP_MILLIS;
+      if(fading < fade.FADE_MILLIS)
+        return (float64)fading / (float64)fade.FADE_MILLIS;
+
+      return (float64)(fade.FADE_MILLIS * 2 - fading) / (float64)fade.FADE_MILLIS;
+    }
+
+    // The old update: frame deltas added to a float, reflected at 1 and 0, the sleep restarted at 0.
+    struct Stepwise
+    {
+      float64 value;
+      bool in;
+      uint32 sleep;
+
+      Stepwise()
+        : value(0), in(true), sleep(0)
+      {
+        ;
+      }
+
+      void Step(const Fade &fade, uint32 elapsed)
+      {
+        sleep += elapsed;
+        if(sleep < fade.SLEEP_MILLIS)
+          return;
+
+        const float64 tick = (float64)elapsed / (float64)fade.FADE_MILLIS;
+
+        value += in ? tick : -tick;
+        if(value >= 1)
+        {
+          in = false;
+          value = 2 - value;
+        }
+        elif(value <= 0)
+        {
+          in = true;
+          sleep = 0;
+          value = -value;
+        }
+      }
+    };
+};
+
+//
+//
+//
+// --bench-timeline: _d_bench_timeline_tracks tracks of _d_bench_timeline_keys keys each, played
+// forward a frame at a time as App plays them, then sought at random. Every value is checked
+// against a linear scan of the keys.
+class TimelineBench
+{
+  public:
+    // False if any value differs.
+    static bool Run()
+    {
+      const uint32 TRACKS = _d_bench_timeline_tracks;
+      const uint32 KEYS = _d_bench_timeline_keys;
+      const TimeMgr::Time FRAME = 16;
+
+      // As a file would hold them. Gaps of 0 make jumps.
+      char *text = new char[TRACKS * (KEYS * 16 + 32) + 1];
+      char *c = text;
+      uint32 seed = 1;
+      TimeMgr::Time end = 0;
+
+      for(uint32 t = 0; t < TRACKS; t++)
+      {
+        c += sprintf(c, "e%u %s", t / Timeline::PropertyCount, Timeline::GetPropertyName((Timeline::Property)(t % Timeline::PropertyCount)));
+
+        uint32 time = 0;
+        for(uint32 k = 0; k < KEYS; k++)
+        {
+          seed = seed * 1664525 + 1013904223;
+          time += (seed >> 16) % 500;
+
+          c += sprintf(c, " %u %u", time, (seed >> 8) % 256);
+        }
+
+        *c++ = '\n';
+
+        if(time > end)
+          end = time;
+      }
+
+      *c = 0;
+
+      //
+      uint64 start = TimeMgr::GetPerfMicros();
+      Timeline *timeline = Timeline::Parse(text);
+      const uint64 parseMicros = TimeMgr::GetPerfMicros() - start;
+
+      delete[] text;
+
+      if(!timeline)
+      {
+        _d_log_err("Timeline bench: the generated text does not parse");
+        return false;
+      }
+
+      const uint32 frames = (uint32)(end / FRAME) + 2;
+      float64 sum = 0;
+
+      start = TimeMgr::GetPerfMicros();
+      for(uint32 f = 0; f < frames; f++)
+        for(uint32 t = 0; t < TRACKS; t++)
+          sum += timeline->Evaluate(t, f * FRAME);
+      const uint64 forwardMicros = TimeMgr::GetPerfMicros() - start;
+
+      start = TimeMgr::GetPerfMicros();
+      for(uint32 i = 0; i < frames * TRACKS; i++)
+      {
+        seed = seed * 1664525 + 1013904223;
+        sum += timeline->Evaluate(i % TRACKS, (seed >> 8) % (end + 1));
+      }
+      const uint64 seekMicros = TimeMgr::GetPerfMicros() - start;
+
+      // The same accesses again, checked.
+      uint32 mismatches = 0;
+
+      for(uint32 f = 0; f < frames; f++)
+        for(uint32 t = 0; t < TRACKS; t++)
+          if(timeline->Evaluate(t, f * FRAME) != GetReference(*timeline, t, f * FRAME))
+            mismatches++;
+
+      for(uint32 i = 0; i < frames * TRACKS; i++)
+      {
+        seed = seed * 1664525 + 1013904223;
+
+        const TimeMgr::Time time = (seed >> 8) % (end + 1);
+        if(timeline->Evaluate(i % TRACKS, time) != GetReference(*timeline, i % TRACKS, time))
+          mismatches++;
+      }
+
+      const float64 evaluations = (float64)frames * TRACKS;
+
+      _d_log_info("Timeline bench: " << TRACKS << " tracks of " << KEYS << " keys, parsed in " << (float64)parseMicros / 1000.0
+        << " ms, " << frames << " frames: " << (float64)forwardMicros * 1000.0 / evaluations << " ns per track played forward ("
+        << (float64)forwardMicros / 1000.0 / frames << " ms a frame), " << (float64)seekMicros * 1000.0 / evaluations
+        << " ns per seek, checksum " << sum);
+
+      if(mismatches)
+        _d_log_err("Timeline bench: " << mismatches << " values differ from a linear scan");
+
+      delete timeline;
+
+      return !mismatches;
+    }
+
+  private:
+    static float64 GetReference(const Timeline &timeline, int32 track, TimeMgr::Time time)
+    {
+      uint32 count;
+      const Timeline::Key *k = timeline.GetKeys(track, count);
+
+      if(time <= k[0].time)
+        return k[0].value;
+      if(time >= k[count - 1].time)
+        return k[count - 1].value;
+
+      uint32 i = 0;
+      while(k[i + 1].time <= time)
+        i++;
+
+      return k[i].value + (k[i + 1].value - k[i].value) * (float64)(time - k[i].time) / (float64)(k[i + 1].time - k[i].time);
+    }
+};
+
+//
+//
+//
+// --bench-fades: _d_bench_fade_bank_count fades with random parameters, evaluated for
+// _d_bench_fade_bank_frames frames one Fade::Calc() at a time, then by a FadeBank with every kernel
+// the CPU has. Every bank value is checked against Fade::Calc(), also days and a month in.
+class FadeBankBench
+{
+  public:
+    // False if any value differs.
+    static bool Run()
+    {
+      const uint32 COUNT = _d_bench_fade_bank_count;
+      const uint32 FRAMES = _d_bench_fade_bank_frames;
+      const TimeMgr::Time FRAME = 16;
+
+      static const TimeMgr::Time CHECKS[] = {0, 1, 999, 3600u * 1000 + 7, 24u * 3600 * 1000 + 13, 30u * 24 * 3600 * 1000 + 17};
+
+      // Fade has const members, so the scalar side is built in place.
+      byte *storage = new byte[COUNT * sizeof(Fade)];
+      Fade *fades = (Fade *)storage;
+      FadeBank bank(COUNT);
+      uint32 seed = 1;
+
+      for(uint32 i = 0; i < COUNT; i++)
+      {
+        seed = seed * 1664525 + 1013904223;
+        const uint32 fadeMillis = (seed >> 8) % 16 ? (seed >> 8) % 3000 + 1 : 0;
+        seed = seed * 1664525 + 1013904223;
+        const uint32 sleepMillis = (seed >> 8) % 4 ? (seed >> 8) % 5000 : 0;
+        seed = seed * 1664525 + 1013904223;
+        const TimeMgr::Time phase = (seed >> 8) % 2 ? (seed >> 8) % 10000 : 0;
+
+        bank.Add(*new(fades + i) Fade(fadeMillis, sleepMillis, phase));
+      }
+
+      //
+      float64 sum = 0;
+
+      uint64 start = TimeMgr::GetPerfMicros();
+      for(uint32 f = 0; f < FRAMES; f++)
+        for(uint32 i = 0; i < COUNT; i++)
+          sum += fades[i].Calc(f * FRAME);
+      const uint64 scalarMicros = TimeMgr::GetPerfMicros() - start;
+
+      const float64 evaluations = (float64)FRAMES * COUNT;
+
+      _d_log_info("Fade bank bench: " << COUNT << " fades, " << FRAMES << " frames, Fade::Calc() "
+        << (float64)scalarMicros * 1000.0 / evaluations << " ns a fade, checksum " << sum);
+
+      //
+      uint32 mismatches = 0;
+
+      for(uint32 k = 0; k < FadeBank::KernelCount; k++)
+      {
+        if(!bank.SetKernel((FadeBank::Kernel)k))
+          continue;
+
+        sum = 0;
+
+        start = TimeMgr::GetPerfMicros();
+        for(uint32 f = 0; f < FRAMES; f++)
+        {
+          bank.Evaluate(f * FRAME);
+          sum += bank.GetAlphas()[f % COUNT];
+        }
+        const uint64 micros = TimeMgr::GetPerfMicros() - start;
+
+        for(uint32 c = 0; c < sizeof(CHECKS) / sizeof(*CHECKS); c++)
+        {
+          bank.Evaluate(CHECKS[c]);
+
+          for(uint32 i = 0; i < COUNT; i++)
+            if(bank.GetAlphas()[i] != (float32)fades[i].Calc(CHECKS[c]))
+              mismatches++;
+        }
+
+        _d_log_info("Fade bank bench: " << FadeBank::GetKernelName((FadeBank::Kernel)k) << " "
+          << (float64)micros * 1000.0 / evaluations << " ns a fade (" << (float64)micros / FRAMES << " us a frame), "
+          << (scalarMicros ? (float64)scalarMicros / (micros ? micros : 1) : 0) << "x Fade::Calc(), checksum " << sum);
+      }
+
+      if(mismatches)
+        _d_log_err("Fade bank bench: " << mismatches << " values differ from Fade::Calc()");
+
+      for(uint32 i = 0; i < COUNT; i++)
+        fades[i].~Fade();
+      delete[] storage;
+
+      return !mismatches;
+    }
+};
+
+//
+//
+//
+// Read-only view of a whole file.
+class MappedFile
+{
+  public:
+    ~MappedFile()
+    {
+      #if _d_os_win
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+      #else
+        munmap((void *)data, size);
+      #endif
+    }
+
+    // One open and one map, pages are read in as they are touched. Null if the file can not be mapped.
+    static MappedFile* Open(const char *path)
+    {
+      #if _d_os_win
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, null, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, null);
+        if(file == INVALID_HANDLE_VALUE)
+          return null;
+
+        const DWORD fileSize = GetFileSize(file, null);
+        HANDLE mapping = fileSize ? CreateFileMappingA(file, null, PAGE_READONLY, 0, 0, null) : null;
+        CloseHandle(file);
+        if(!mapping)
+          return null;
+
+        const byte *data = (const byte *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if(!data)
+        {
+          CloseHandle(mapping);
+          return null;
+        }
+
+        return new MappedFile(data, fileSize, mapping);
+      #else
+        const int file = open(path, O_RDONLY);
+        if(file < 0)
+          return null;
+
+        struct stat info;
+        void *data = MAP_FAILED;
+        if(!fstat(file, &info) && info.st_size > 0)
+          data = mmap(null, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        close(file);
+
+        if(data == MAP_FAILED)
+          return null;
+
+        return new MappedFile((const byte *)data, (uint32)info.st_size, null);
+      #endif
+    }
+
+    const byte* GetData() const
+    {
+      return data;
+    }
+
+    uint32 GetSize() const
+    {
+      return size;
+    }
+
+  private:
+    const byte *const data;
+    const uint32 size;
+
+    // The mapping object on Windows.
+    void *const mapping;
+
+    MappedFile(const byte *data, uint32 size, void *mapping)
+      : data(data), size(size), mapping(mapping)
+    {
+      ;
+    }
+};
+
+//
+//
+//
+// Read-only archive: a header, an index of named entries, then the blobs, each aligned to
+// _d_asset_pack_alignment. Entries are handed out as SDL_RWFromConstMem() views, nothing is copied.
+class AssetPack
+{
+  public:
+    // "NCBP", little endian.
+    static const uint32 MAGIC = 0x50424e43;
+    static const uint32 VERSION = 1;
+
+    struct Header
+    {
+      uint32 magic;
+      uint32 version;
+      uint32 count;
+      uint32 reserved;
+    };
+
+    struct Entry
+    {
+      char name[_d_asset_pack_name_length];
+      uint32 offset;
+      uint32 size;
+    };
+
+    // Over memory that outlives the pack, e.g. linked into the binary.
+    AssetPack(const byte *data, uint32 size)
+      : data(data), size(size), file(null)
+    {
+      Validate();
+    }
+
+    ~AssetPack()
+    {
+      delete file;
+    }
+
+    // Null if the file is missing and not required.
+    static AssetPack* Map(const char *path, bool required = true)
+    {
+      MappedFile *file = MappedFile::Open(path);
+      if(!file && required)
+        _d_log_fatal("AssetPack: failed to map " << path);
+
+      return file ? new AssetPack(file) : null;
+    }
+
+    // Null if there is no such entry.
+    SDL_RWops* Open(const char *name) const
+    {
+      const Header &header = *(const Header *)data;
+      const Entry *entries = (const Entry *)(data + sizeof(Header));
+
+      for(uint32 i = 0; i < header.count; i++)
+        if(!strncmp(entries[i].name, name, _d_asset_pack_name_length))
+          return SDL_RWFromConstMem(data + entries[i].offset, entries[i].size);
+
+      SDL_SetError("AssetPack: no entry %s", name);
+      return null;
+    }
+
+    // Offline: packs files under the given names.
+    static bool Write(const char *path, const char *const *names, const char *const *files, uint32 count)
+    {
+      Header header;
+      header.magic = MAGIC;
+      header.version = VERSION;
+      header.count = count;
+      header.reserved = 0;
+
+      Entry *entries = new Entry[count];
+      uint32 offset = sizeof(Header) + count * sizeof(Entry);
+
+      for(uint32 i = 0; i < count; i++)
+      {
+        FILE *in = fopen(files[i], "rb");
+        if(!in)
+        {
+          _d_log_err("AssetPack: failed to open " << files[i]);
+          delete[] entries;
+          return false;
+        }
+
+        fseek(in, 0, SEEK_END);
+        const long inSize = ftell(in);
+        fclose(in);
+
+        memset(entries[i].name, 0, _d_asset_pack_name_length);
+        strncpy(entries[i].name, names[i], _d_asset_pack_name_length - 1);
+
+        offset = Align(offset);
+        entries[i].offset = offset;
+        entries[i].size = (uint32)inSize;
+        offset += entries[i].size;
+      }
+
+      FILE *out = fopen(path, "wb");
+      if(!out)
+      {
+        _d_log_err("AssetPack: failed to create " << path);
+        delete[] entries;
+        return false;
+      }
+
+      fwrite(&header, sizeof(Header), 1, out);
+      fwrite(entries, sizeof(Entry), count, out);
+
+      byte buffer[4096];
+      for(uint32 i = 0; i < count; i++)
+      {
+        while((uint32)ftell(out) < entries[i].offset)
+          fputc(0, out);
+
+        FILE *in = fopen(files[i], "rb");
+        size_t read;
+        while(in && (read = fread(buffer, 1, sizeof(buffer), in)) > 0)
+          fwrite(buffer, 1, read, out);
+        if(in)
+          fclose(in);
+
+        _d_log_info("AssetPack: " << entries[i].name << ", " << entries[i].size << " bytes at " << entries[i].offset);
+      }
+
+      const bool ok = !ferror(out);
+      fclose(out);
+      delete[] entries;
+
+      return ok;
+    }
+
+  private:
+    const byte *const data;
+    const uint32 size;
+
+    // Null unless the pack was mapped from disk.
+    MappedFile *const file;
+
+    AssetPack(MappedFile *file)
+      : data(file->GetData()), size(file->GetSize()), file(file)
+    {
+      Validate();
+    }
+
+    static uint32 Align(uint32 offset)
+    {
+      return (offset + _d_asset_pack_alignment - 1) / _d_asset_pack_alignment * _d_asset_pack_alignment;
+    }
+
+    void Validate() const
+    {
+      const Header &header = *(const Header *)data;
+      if(size < sizeof(Header) || header.magic != MAGIC || header.version != VERSION
+        || header.count > (size - sizeof(Header)) / sizeof(Entry))
+        _d_log_fatal("AssetPack: not a pack, or version mismatch");
+
+      const Entry *entries = (const Entry *)(data + sizeof(Header));
+      for(uint32 i = 0; i < header.count; i++)
+        if(entries[i].offset > size || entries[i].size > size - entries[i].offset)
+          _d_log_fatal("AssetPack: entry " << i << " out of bounds");
+    }
+};
+
+#if _d_asset_pack_embedded
+  // GCC or Clang with ELF output. The path is relative to the compiler's working directory.
+  __asm__(
+    ".section .rodata\n"
+    ".balign " _d_quote_value(_d_asset_pack_alignment) "\n"
+    ".globl AssetPackData\n"
+    "AssetPackData:\n"
+    ".incbin \"" _d_asset_pack_file "\"\n"
+    ".globl AssetPackDataEnd\n"
+    "AssetPackDataEnd:\n"
+    ".previous\n");
+
+  extern "C" const byte AssetPackData[];
+  extern "C" const byte AssetPackDataEnd[];
+#endif
+
+//
+//
+//
+// What the offline optimizer (Optimizer.cpp) packed: atlas pages of one TextureFormat each, deflated,
+// and the sprites on them, trimmed to their non-transparent texels. Pages are pack entries of their own.
+class AssetManifest
+{
+  public:
+    // "NCBM", little endian.
+    static const uint32 MAGIC = 0x4d42434e;
+    static const uint32 VERSION = 1;
+
+    // Pages with both color and alpha store color premultiplied.
+    static const uint32 FLAG_PREMULTIPLIED = 1;
+
+    struct Header
+    {
+      uint32 magic;
+      uint32 version;
+      uint32 flags;
+      uint32 pageCount;
+      uint32 spriteCount;
+      uint32 reserved[3];
+    };
+
+    struct Page
+    {
+      char name[_d_asset_pack_name_length];
+      uint32 width;
+      uint32 height;
+      uint32 format;
+
+      // Inflated.
+      uint32 size;
+    };
+
+    struct Sprite
+    {
+      char name[_d_asset_pack_name_length];
+      uint32 page;
+
+      // Within the page.
+      uint32 x;
+      uint32 y;
+      uint32 width;
+      uint32 height;
+
+      // Within the source image.
+      uint32 trimX;
+      uint32 trimY;
+      uint32 sourceWidth;
+      uint32 sourceHeight;
+    };
+
+    ~AssetManifest()
+    {
+      delete[] data;
+    }
+
+    // Null if rw does not hold a manifest of this version.
+    static AssetManifest* Read(SDL_RWops *rw)
+    {
+      const int size = SDL_RWseek(rw, 0, RW_SEEK_END);
+      SDL_RWseek(rw, 0, RW_SEEK_SET);
+      if(size < (int)sizeof(Header))
+        return null;
+
+      byte *data = new byte[size];
+      const Header &header = *(const Header *)data;
+
+      if(SDL_RWread(rw, data, size, 1) != 1 || header.magic != MAGIC || header.version != VERSION
+        || (uint32)size != sizeof(Header) + header.pageCount * sizeof(Page) + header.spriteCount * sizeof(Sprite))
+      {
+        delete[] data;
+        return null;
+      }
+
+      AssetManifest *manifest = new AssetManifest(data);
+      for(uint32 i = 0; i < header.spriteCount; i++)
+      {
+        const Sprite &sprite = manifest->GetSprite(i);
+        if(sprite.page >= header.pageCount
+          || sprite.x + sprite.width > manifest->GetPage(sprite.page).width
+          || sprite.y + sprite.height > manifest->GetPage(sprite.page).height)
+        {
+          delete manifest;
+          return null;
+        }
+      }
+
+      return manifest;
+    }
+
+    const Header& GetHeader() const
+    {
+      return *(const Header *)data;
+    }
+
+    const Page& GetPage(uint32 index) const
+    {
+      return ((const Page *)(data + sizeof(Header)))[index];
+    }
+
+    const Sprite& GetSprite(uint32 index) const
+    {
+      return ((const Sprite *)(data + sizeof(Header) + GetHeader().pageCount * sizeof(Page)))[index];
+    }
+
+    // Null if there is no such sprite.
+    const Sprite* FindSprite(const char *name) const
+    {
+      for(uint32 i = 0; i < GetHeader().spriteCount; i++)
+        if(!strncmp(GetSprite(i).name, name, _d_asset_pack_name_length))
+          return &GetSprite(i);
+
+      return null;
+    }
+
+    // Inflates a page from its pack entry into RGBA, as CreateRgbaSurface(), premultiplied as the
+    // renderers blend. Null if rw does not hold the page.
+    SDL_Surface* LoadPage(uint32 index, SDL_RWops *rw) const
+    {
+      const Page &page = GetPage(index);
+      const TextureFormat::Type format = (TextureFormat::Type)page.format;
+      const uint32 texelBytes = GetTexelBytes(format);
+
+      const int packedSize = SDL_RWseek(rw, 0, RW_SEEK_END);
+      SDL_RWseek(rw, 0, RW_SEEK_SET);
+      if(!texelBytes || page.size != page.width * page.height * texelBytes || packedSize <= 0)
+        return null;
+
+      byte *packed = new byte[packedSize];
+      byte *texels = new byte[page.size];
+      uLongf size = page.size;
+
+      const bool ok = SDL_RWread(rw, packed, packedSize, 1) == 1
+        && uncompress(texels, &size, packed, packedSize) == Z_OK && size == page.size;
+      delete[] packed;
+
+      if(!ok)
+      {
+        delete[] texels;
+        return null;
+      }
+
+      // Masks and opaque pages are the same either way.
+      const bool convert = !(GetHeader().flags & FLAG_PREMULTIPLIED);
+
+      SDL_Surface *rgba = CreateRgbaSurface(page.width, page.height);
+      const byte *src = texels;
+
+      for(uint32 y = 0; y < page.height; y++)
+      {
+        uint32 *dest = (uint32 *)((byte *)rgba->pixels + y * rgba->pitch);
+
+        for(uint32 x = 0; x < page.width; x++, src += texelBytes)
+        {
+          uint32 r, g, b, a;
+
+          if(format == TextureFormat::Rgba8)
+          {
+            r = src[0];
+            g = src[1];
+            b = src[2];
+            a = src[3];
+          }
+          elif(format == TextureFormat::Rgb8)
+          {
+            r = src[0];
+            g = src[1];
+            b = src[2];
+            a = 0xff;
+          }
+          elif(format == TextureFormat::LuminanceAlpha8)
+          {
+            r = g = b = src[0];
+            a = src[1];
+          }
+          elif(format == TextureFormat::Luminance8)
+          {
+            r = g = b = src[0];
+            a = 0xff;
+          }
+          else
+          {
+            r = g = b = src[0];
+            a = src[0];
+          }
+
+          if(convert && a != 0xff && (format == TextureFormat::Rgba8 || format == TextureFormat::LuminanceAlpha8))
+          {
+            r = Premultiply(r, a);
+            g = Premultiply(g, a);
+            b = Premultiply(b, a);
+          }
+
+          dest[x] = r | (g << 8) | (b << 16) | (a << 24);
+        }
+      }
+
+      delete[] texels;
+
+      return rgba;
+    }
+
+    // Offline: the page's texels in its format, deflated. The caller deletes the result.
+    static byte* EncodePage(const SDL_Surface *rgba, TextureFormat::Type format, bool premultiply, uint32 &size)
+    {
+      const uint32 texelBytes = GetTexelBytes(format);
+      if(!texelBytes)
+        _d_log_fatal("AssetManifest: can not store " << TextureFormat::GetName(format));
+
+      const uint32 rawSize = rgba->w * rgba->h * texelBytes;
+      byte *texels = new byte[rawSize];
+      byte *dest = texels;
+
+      for(GLint y = 0; y < rgba->h; y++)
+      {
+        const uint32 *row = (const uint32 *)((const byte *)rgba->pixels + y * rgba->pitch);
+
+        for(GLint x = 0; x < rgba->w; x++, dest += texelBytes)
+        {
+          uint32 r = row[x] & 0xff;
+          uint32 g = (row[x] >> 8) & 0xff;
+          uint32 b = (row[x] >> 16) & 0xff;
+          const uint32 a = row[x] >> 24;
+
+          if(premultiply)
+          {
+            r = Premultiply(r, a);
+            g = Premultiply(g, a);
+            b = Premultiply(b, a);
+          }
+
+          if(format == TextureFormat::Rgba8)
+          {
+            dest[0] = (byte)r;
+            dest[1] = (byte)g;
+            dest[2] = (byte)b;
+            dest[3] = (byte)a;
+          }
+          elif(format == TextureFormat::Rgb8)
+          {
+            dest[0] = (byte)r;
+            dest[1] = (byte)g;
+            dest[2] = (byte)b;
+          }
+          elif(format == TextureFormat::LuminanceAlpha8)
+          {
+            dest[0] = (byte)r;
+            dest[1] = (byte)a;
+          }
+          elif(format == TextureFormat::Luminance8)
+            dest[0] = (byte)r;
+          else
+            dest[0] = (byte)a;
+        }
+      }
+
+      uLongf packedSize = compressBound(rawSize);
+      byte *packed = new byte[packedSize];
+      if(compress2(packed, &packedSize, texels, rawSize, Z_BEST_COMPRESSION) != Z_OK)
+        _d_log_fatal("AssetManifest: compress2() failed");
+
+      delete[] texels;
+
+      size = (uint32)packedSize;
+      return packed;
+    }
+
+    // Zero for formats that are never stored.
+    static uint32 GetTexelBytes(TextureFormat::Type format)
+    {
+      if(format == TextureFormat::Rgb565 || format == TextureFormat::Dxt1)
+        return 0;
+
+      return TextureFormat::GetBits(format) / 8;
+    }
+
+  private:
+    byte *const data;
+
+    AssetManifest(byte *data)
+      : data(data)
+    {
+      ;
+    }
+
+    // Multiplies color by alpha, or divides it back out.
+    // As PremultiplyAlpha() rounds.
+    static uint32 Premultiply(uint32 c, uint32 a)
+    {
+      return Div255(c * a);
+    }
+};
+
+// An optimizer page, inflated from the pack again. Both must outlive it.
+class ManifestPageSource : public PageSource
+{
+  public:
+    const AssetManifest &manifest;
+    const AssetPack &pack;
+
+    const uint32 INDEX;
+
+    ManifestPageSource(const AssetManifest &manifest, const AssetPack &pack, uint32 index)
+      : manifest(manifest), pack(pack), INDEX(index)
+    {
+      ;
+    }
+
+    SDL_Surface* Load()
+    {
+      SDL_RWops *rw = pack.Open(manifest.GetPage(INDEX).name);
+      if(!rw)
+        return null;
+
+      SDL_Surface *rgba = manifest.LoadPage(INDEX, rw);
+      SDL_FreeRW(rw);
+
+      return rgba;
+    }
+};
+
+//
+//
+//
+// Decoded images on disk, keyed by a hash of the encoded bytes and the pixel format, so an edited
+// asset simply misses. Hits are mapped and wrapped in a surface without a copy; the pixels stay
+// valid while the cache exists.
+class ImageCache
+{
+  public:
+    // "NCBI", little endian.
+    static const uint32 MAGIC = 0x4942434e;
+    static const uint32 VERSION = 1;
+
+    const char *const DIRECTORY;
+
+    ImageCache(const char *dir)
+      : DIRECTORY(dir), fileCount(0), hits(0), misses(0)
+    {
+      #if _d_enable_image_cache
+        #if _d_os_win
+          CreateDirectoryA(DIRECTORY, null);
+        #else
+          mkdir(DIRECTORY, 0755);
+        #endif
+      #endif
+    }
+
+    ~ImageCache()
+    {
+      for(uint32 i = 0; i < fileCount; i++)
+        delete files[i];
+
+      #if _d_enable_image_cache
+        _d_log_info("ImageCache: " << hits << " hits, " << misses << " misses");
+      #endif
+    }
+
+    // FNV-1a of the encoded bytes, then of the format tag and of the scale unless 1, so unscaled
+    // entries keep their keys.
+    static uint64 GetKey(const byte *data, uint32 size, float64 scale)
+    {
+      uint64 hash = 14695981039346656037ull;
+
+      for(uint32 i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 1099511628211ull;
+
+      for(const char *p = _d_image_cache_format; *p; p++)
+        hash = (hash ^ (byte)*p) * 1099511628211ull;
+
+      if(scale != 1.0)
+        for(uint32 i = 0; i < sizeof(scale); i++)
+          hash = (hash ^ ((const byte *)&scale)[i]) * 1099511628211ull;
+
+      return hash;
+    }
+
+    // RGBA in memory order, as CreateRgbaSurface(), or null on a miss. Main thread only, the
+    // surface is SDL's.
+    SDL_Surface* Find(uint64 key)
+    {
+      #if !_d_enable_image_cache
+        return null;
+      #else
+        char path[256];
+        GetPath(key, path);
+
+        SDL_Surface *cached = Map(path, key);
+        (cached ? hits : misses)++;
+
+        return cached;
+      #endif
+    }
+
+    // Safe to call from several threads, only the pixels and the file are touched.
+    void Store(uint64 key, const SDL_Surface *rgba) const
+    {
+      #if _d_enable_image_cache
+        char path[256];
+        GetPath(key, path);
+
+        Write(path, key, rgba);
+      #endif
+    }
+
+  private:
+    struct Header
+    {
+      uint32 magic;
+      uint32 version;
+      uint64 key;
+      uint32 width;
+      uint32 height;
+      uint32 pitch;
+
+      // Of the first row, from the start of the file.
+      uint32 offset;
+    };
+
+    MappedFile *files[_d_image_cache_max_files];
+    uint32 fileCount;
+
+    uint32 hits;
+    uint32 misses;
+
+    void GetPath(uint64 key, char *path) const
+    {
+      sprintf(path, "%s/%08x%08x.img", DIRECTORY, (uint32)(key >> 32), (uint32)key);
+    }
+
+    SDL_Surface* Map(const char *path, uint64 key)
+    {
+      MappedFile *file = MappedFile::Open(path);
+      if(!file)
+        return null;
+
+      const Header &header = *(const Header *)file->GetData();
+      if(file->GetSize() < sizeof(Header) || header.magic != MAGIC || header.version != VERSION || header.key != key
+        || header.pitch < header.width * 4 || file->GetSize() < header.offset + (uint64)header.pitch * header.height)
+      {
+        _d_log_warn("ImageCache: ignoring stale " << path);
+        delete file;
+        return null;
+      }
+
+      if(fileCount == _d_image_cache_max_files)
+      {
+        delete file;
+        return null;
+      }
+
+      // SDL never writes to these pixels, surfaces only get blitted from or uploaded.
+      SDL_Surface *surface = SDL_CreateRGBSurfaceFrom((void *)(file->GetData() + header.offset),
+        header.width, header.height, 32, header.pitch,
+        0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+      if(!surface)
+      {
+        delete file;
+        return null;
+      }
+
+      files[fileCount++] = file;
+
+      return surface;
+    }
+
+    // Written to a temporary name first, so a crash never leaves a torn entry behind.
+    static void Write(const char *path, uint64 key, const SDL_Surface *surface)
+    {
+      char temp[260];
+      sprintf(temp, "%s.tmp", path);
+
+      FILE *out = fopen(temp, "wb");
+      if(!out)
+      {
+        _d_log_warn("ImageCache: failed to create " << temp);
+        return;
+      }
+
+      Header header;
+      memset(&header, 0, sizeof(header));
+      header.magic = MAGIC;
+      header.version = VERSION;
+      header.key = key;
+      header.width = surface->w;
+      header.height = surface->h;
+      header.pitch = surface->w * 4;
+      header.offset = _d_image_cache_alignment;
+
+      fwrite(&header, sizeof(Header), 1, out);
+      for(uint32 i = sizeof(Header); i < header.offset; i++)
+        fputc(0, out);
+
+      for(GLint y = 0; y < surface->h; y++)
+        fwrite((const byte *)surface->pixels + y * surface->pitch, 4, surface->w, out);
+
+      const bool ok = !ferror(out);
+      fclose(out);
+
+      remove(path);
+      if(!ok || rename(temp, path))
+      {
+        _d_log_warn("ImageCache: failed to write " << path);
+        remove(temp);
+      }
+    }
+};
+
+//
+//
+//
+// From the IHDR chunk, without decoding. False if data is not a PNG.
+bool GetPngSize(const byte *data, uint32 size, GLint &width, GLint &height)
+{
+  if(size < 24 || png_sig_cmp((png_bytep)data, 0, 8) || memcmp(data + 12, "IHDR", 4))
+    return false;
+
+  width = (GLint)((uint32)data[16] << 24 | (uint32)data[17] << 16 | (uint32)data[18] << 8 | data[19]);
+  height = (GLint)((uint32)data[20] << 24 | (uint32)data[21] << 16 | (uint32)data[22] << 8 | data[23]);
+
+  return width > 0 && height > 0;
+}
+
+struct PngInput
+{
+  const byte *data;
+  uint32 size;
+  uint32 offset;
+};
+
+void ReadPngInput(png_structp png, png_bytep out, png_size_t length)
+{
+  PngInput &input = *(PngInput *)png_get_io_ptr(png);
+  if(length > input.size - input.offset)
+    png_error(png, "unexpected end of data");
+
+  memcpy(out, input.data + input.offset, length);
+  input.offset += (uint32)length;
+}
+
+// Any PNG as 8-bit RGBA in memory order, as CreateRgbaSurface(), into pixels the caller sized with
+// GetPngSize(). Only touches memory, any thread may call it.
+bool DecodePng(const byte *data, uint32 size, byte *pixels, GLint width, GLint height, uint32 pitch)
+{
+  PngInput input = {data, size, 0};
+
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, null, null, null);
+  png_infop info = png ? png_create_info_struct(png) : null;
+
+  // libpng reports errors with longjmp().
+  if(!info || setjmp(png_jmpbuf(png)))
+  {
+    png_destroy_read_struct(&png, &info, null);
+    return false;
+  }
+
+  png_set_read_fn(png, &input, ReadPngInput);
+  png_read_info(png, info);
+
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_gray_to_rgb(png);
+  png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+  const int passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  if((GLint)png_get_image_width(png, info) != width || (GLint)png_get_image_height(png, info) != height
+    || png_get_rowbytes(png, info) != (png_uint_32)width * 4)
+    png_error(png, "unexpected size");
+
+  // Interlaced images fill the same rows once per pass.
+  for(int pass = 0; pass < passes; pass++)
+    for(GLint y = 0; y < height; y++)
+      png_read_row(png, (png_bytep)(pixels + y * pitch), null);
+
+  png_read_end(png, null);
+  png_destroy_read_struct(&png, &info, null);
+
+  return true;
+}
+
+//
+//
+//
+bool SavePng(const char *path, const byte *rgb, uint32 width, uint32 height)
+{
+  FILE *file = fopen(path, "wb");
+  if(!file)
+  {
+    _d_log_err("SavePng(): failed to open " << path);
+    return false;
+  }
+
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, null, null, null);
+  png_infop info = png ? png_create_info_struct(png) : null;
+
+  // libpng reports errors with longjmp().
+  if(!info || setjmp(png_jmpbuf(png)))
+  {
+    png_destroy_write_struct(&png, &info);
+    fclose(file);
+
+    _d_log_err("SavePng(): failed to write " << path);
+    return false;
+  }
+
+  png_init_io(png, file);
+  png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+    PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+
+  for(uint32 y = 0; y < height; y++)
+    png_write_row(png, (png_bytep)(rgb + y * width * 3));
+
+  png_write_end(png, null);
+  png_destroy_write_struct(&png, &info);
+  fclose(file);
+
+  return true;
+}
+
+//
+//
+//
+// Ring of GL_TIME_ELAPSED queries. Results are collected frames later, so the CPU never waits on the GPU.
+class GpuTimer
+{
+  public:
+    const GlCaps &caps;
+
+    GpuTimer(const GlCaps &caps)
+      : caps(caps), head(0), tail(0), active(false)
+    {
+      caps.glGenQueries(_d_profiler_gpu_queries, queries);
+    }
+
+    ~GpuTimer()
+    {
+      caps.glDeleteQueries(_d_profiler_gpu_queries, queries);
+    }
+
+    // Skipped while every query is still pending.
+    void Begin()
+    {
+      active = head - tail < _d_profiler_gpu_queries;
+      if(active)
+        caps.glBeginQuery(GL_TIME_ELAPSED, queries[head % _d_profiler_gpu_queries]);
+    }
+
+    void End()
+    {
+      if(!active)
+        return;
+
+      caps.glEndQuery(GL_TIME_ELAPSED);
+      head++;
+    }
+
+    // Oldest finished measurement.
+    bool Poll(uint64 &micros)
+    {
+      if(tail == head)
+        return false;
+
+      const GLuint query = queries[tail % _d_profiler_gpu_queries];
+
+      GLint available = 0;
+      caps.glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if(!available)
+        return false;
+
+      uint64 nanos = 0;
+      caps.glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanos);
+      tail++;
+
+      micros = nanos / 1000;
+      return true;
+    }
+
+  private:
+    GLuint queries[_d_profiler_gpu_queries];
+
+    uint32 head;
+    uint32 tail;
+    bool active;
+};
+
+//
+//
+//
+// Log-linear buckets in microseconds: exact below 16, then 8 buckets per power of two,
+// so a percentile is off by at most 1/8.
+class Histogram
+{
+  public:
+    Histogram()
+    {
+      Reset();
+    }
+
+    void Reset()
+    {
+      memset(counts, 0, sizeof(counts));
+      count = 0;
+      max = 0;
+    }
+
+    void Add(uint64 micros)
+    {
+      counts[GetBucket(micros)]++;
+      count++;
+
+      if(micros > max)
+        max = micros;
+    }
+
+    uint32 GetCount() const
+    {
+      return count;
+    }
+
+    uint64 GetMax() const
+    {
+      return max;
+    }
+
+    // Upper bound of the bucket holding the p-th fraction of samples.
+    uint64 GetPercentile(float64 p) const
+    {
+      const uint32 rank = (uint32)::ceil(p * count);
+      uint32 seen = 0;
+
+      for(uint32 b = 0; b < _d_profiler_buckets; b++)
+      {
+        seen += counts[b];
+        if(seen >= rank && seen)
+        {
+          const uint64 top = GetBucketTop(b);
+          return top < max ? top : max;
+        }
+      }
+
+      return max;
+    }
+
+  private:
+    uint32 counts[_d_profiler_buckets];
+    uint32 count;
+    uint64 max;
+
+    static uint32 GetBucket(uint64 micros)
+    {
+      if(micros < 16)
+        return (uint32)micros;
+
+      uint32 e = 4;
+      while(micros >> (e + 1))
+        e++;
+
+      const uint32 b = 16 + (e - 4) * 8 + (uint32)((micros >> (e - 3)) & 7);
+      return b < _d_profiler_buckets ? b : _d_profiler_buckets - 1;
+    }
+
+    static uint64 GetBucketTop(uint32 b)
+    {
+      if(b < 16)
+        return b;
+
+      const uint32 e = (b - 16) / 8 + 4;
+      const uint64 low = (uint64)(8 + (b - 16) % 8) << (e - 3);
+
+      return low + ((uint64)1 << (e - 3)) - 1;
+    }
+};
+
+//
+//
+//
+class Profiler
+{
+  public:
+    enum Phase
+    {
+      PhaseWait,
+      PhaseUpdate,
+      PhaseStream,
+      PhaseFade,
+      PhaseDamage,
+      PhaseDraw,
+      PhasePresent,
+      PhaseFrame,
+      PhaseGpu,
+      PhaseCount
+    };
+
+    // Adds the lifetime of the scope to a phase.
+    class Scope
+    {
+      public:
+        Scope(Profiler &profiler, Phase phase)
+          : profiler(profiler), phase(phase), start(TimeMgr::GetPerfMicros())
+        {
+          ;
+        }
+
+        ~Scope()
+        {
+          profiler.Add(phase, TimeMgr::GetPerfMicros() - start);
+        }
+
+      private:
+        Profiler &profiler;
+        const Phase phase;
+        const uint64 start;
+    };
+
+    void Add(Phase phase, uint64 micros)
+    {
+      histograms[phase].Add(micros);
+    }
+
+    void Report() const
+    {
+      static const char *const NAMES[PhaseCount] =
+        {"wait", "update", "stream", "fade", "damage", "draw", "present", "frame", "gpu"};
+
+      for(uint32 i = 0; i < PhaseCount; i++)
+      {
+        const Histogram &h = histograms[i];
+        if(!h.GetCount())
+          continue;
+
+        _d_log_info("Profile: " << NAMES[i] << ": " << h.GetCount() << " samples, ms"
+          << " p50 " << (float64)h.GetPercentile(0.50) / 1000.0
+          << ", p95 " << (float64)h.GetPercentile(0.95) / 1000.0
+          << ", p99 " << (float64)h.GetPercentile(0.99) / 1000.0
+          << ", max " << (float64)h.GetMax() / 1000.0);
+      }
+    }
+
+    // SIGUSR1, or SIGBREAK on Windows, asks for a report at the next frame.
+    static void OnSignal(int s)
+    {
+      GetReportRequest() = 1;
+      signal(s, OnSignal);
+    }
+
+    static bool TakeReportRequest()
+    {
+      if(!GetReportRequest())
+        return false;
+
+      GetReportRequest() = 0;
+      return true;
+    }
+
+  private:
+    Histogram histograms[PhaseCount];
+
+    static volatile sig_atomic_t& GetReportRequest()
+    {
+      static volatile sig_atomic_t request = 0;
+
+      return request;
+    }
+};
+
+#if _d_enable_profiler
+  #define _d_profile(__phase) Profiler::Scope _d_profile_##__phase(*profiler, Profiler::__phase)
+#else
+  #define _d_profile(__phase)
+#endif
+
+//
+//
+//
+// Simulation at a fixed rate, whatever rate frames are drawn at. Each frame Advance() says how many
+// steps are due, GetAlpha() how far the frame lies past the last one.
+class FixedStep
+{
+  public:
+    const TimeMgr::Nanos STEP;
+
+    // Per frame. A longer stall is dropped rather than caught up with.
+    const uint32 MAX_STEPS;
+
+    FixedStep(uint32 hz, uint32 maxSteps, TimeMgr::Nanos start)
+      : STEP(1000000000 / hz), MAX_STEPS(maxSteps), time(start), steps(0)
+    {
+      ;
+    }
+
+    GLdouble GetStepMillis() const
+    {
+      return (GLdouble)STEP / 1000000.0;
+    }
+
+    uint32 Advance(TimeMgr::Nanos now)
+    {
+      uint32 due = 0;
+      while(now - time >= STEP && due < MAX_STEPS)
+      {
+        time += STEP;
+        due++;
+      }
+
+      if(now - time >= STEP)
+        time = now - (now - time) % STEP;
+
+      steps += due;
+
+      return due;
+    }
+
+    // In [0, 1).
+    GLdouble GetAlpha(TimeMgr::Nanos now) const
+    {
+      return (GLdouble)(now - time) / (GLdouble)STEP;
+    }
+
+    // Taken since the last call.
+    uint32 TakeSteps()
+    {
+      const uint32 taken = steps;
+      steps = 0;
+
+      return taken;
+    }
+
+  private:
+    // Of the last step.
+    TimeMgr::Nanos time;
+
+    uint32 steps;
+};
+
+//
+//
+//
+class FrameScheduler
+{
+  public:
+    static const TimeMgr::Time NEVER = ~(TimeMgr::Time)0;
+
+    const TimeMgr::Time MIN_FRAME_MILLIS;
+
+    FrameScheduler(uint32 maxFps)
+      : MIN_FRAME_MILLIS(maxFps ? 1000 / maxFps : 0),
+        frameTime(0), exposed(false),
+        wakeups(0), frames(0), statsTime(0)
+    {
+      ;
+    }
+
+    static TimeMgr::Time Min(TimeMgr::Time a, TimeMgr::Time b)
+    {
+      return a < b ? a : b;
+    }
+
+    // Blocks until the deadline or until an input event arrives, but in either case not sooner
+    // than MIN_FRAME_MILLIS after the previous frame. Returns false on SDL_QUIT.
+    bool Wait(TimeMgr::Time deadline)
+    {
+      if(deadline != NEVER && deadline < frameTime + MIN_FRAME_MILLIS)
+        deadline = frameTime + MIN_FRAME_MILLIS;
+
+      exposed = false;
+
+      TimeMgr::Time currentTime;
+      bool input = false;
+
+      forever
+      {
+        SDL_Event e;
+        while(SDL_PollEvent(&e))
+          if(!Handle(e, input))
+            return false;
+
+        // Input redraws as soon as the cap allows.
+        if(input && deadline > frameTime + MIN_FRAME_MILLIS)
+          deadline = frameTime + MIN_FRAME_MILLIS;
+
+        currentTime = TimeMgr::GetTicks();
+        if(currentTime >= deadline)
+          break;
+
+        // SDL 1.2 has no timed wait, a timer event ends SDL_WaitEvent() instead.
+        SDL_TimerID timer = deadline == NEVER ? null : SDL_AddTimer((Uint32)(deadline - currentTime), OnTimer, null);
+
+        if(!SDL_WaitEvent(&e))
+          _d_log_err("SDL_WaitEvent(): " << SDL_GetError());
+
+        if(timer)
+          SDL_RemoveTimer(timer);
+
+        wakeups++;
+
+        if(!Handle(e, input))
+          return false;
+      }
+
+      frameTime = currentTime;
+      frames++;
+
+      #if _d_enable_scheduler_stats
+        if(currentTime - statsTime >= _d_app_stats_interval)
+        {
+          const float64 seconds = (float64)(currentTime - statsTime) / 1000.0;
+
+          _d_log_info("Scheduler: " << (float64)wakeups / seconds << " wakeups/s, "
+            << (float64)frames / seconds << " frames/s");
+
+          wakeups = 0;
+          frames = 0;
+          statsTime = currentTime;
+        }
+      #endif
+
+      return true;
+    }
+
+    // The window was uncovered during the last Wait(), its contents have to be redrawn.
+    bool WasExposed() const
+    {
+      return exposed;
+    }
+
+  private:
+    TimeMgr::Time frameTime;
+    bool exposed;
+
+    uint32 wakeups;
+    uint32 frames;
+    TimeMgr::Time statsTime;
+
+    bool Handle(const SDL_Event &e, bool &input)
+    {
+      if(e.type == SDL_QUIT)
+        return false;
+
+      if(e.type == SDL_VIDEOEXPOSE)
+        exposed = true;
+
+      if(e.type != SDL_USEREVENT)
+        input = true;
+
+      return true;
+    }
+
+    static Uint32 SDLCALL OnTimer(Uint32 /*interval*/, void * /*param*/)
+    {
+      SDL_Event e;
+      e.type = SDL_USEREVENT;
+      e.user.code = 0;
+      e.user.data1 = null;
+      e.user.data2 = null;
+      SDL_PushEvent(&e);
+
+      // One shot.
+      return 0;
+    }
+};
+
+//
+//
+//
+class App : private WorkStealingPool::Job
+{
+  public:
+    const uint32 SCREEN_WIDTH;
+    const uint32 SCREEN_HEIGHT;
+
+    // Every position is given in this space, see ScaleMode.
+    const uint32 VIEW_WIDTH;
+    const uint32 VIEW_HEIGHT;
+
+    const uint32 SOUND_VOLUME;
+    const char *const WINDOW_CAPTION;
+
+    enum RendererType
+    {
+      RendererGl,
+      RendererCpu
+    };
+
+    const RendererType RENDERER;
+
+    // 0 uses every core.
+    const uint32 RENDERER_THREADS;
+
+    // How the view is scaled into a window of another size. CpuRenderer only draws unscaled.
+    enum ScaleMode
+    {
+      // Drawn straight into the window, the assets are stretched as they are sampled.
+      ScaleNative,
+
+      // Drawn into a framebuffer object of the view's size, stretched to the window once per frame.
+      ScaleTarget,
+
+      // Drawn straight into the window, the assets are resampled to its resolution once and cached.
+      ScaleAssets
+    };
+
+    const ScaleMode SCALE;
+
+    // Bytes of texels kept resident, 0 for no limit. See TextureManager.
+    const uint32 TEXTURE_BUDGET;
+
+    // Renders FRAMES frames with the CPU renderer and SDL's dummy video driver, as fast as possible,
+    // advancing a virtual clock by STEP per frame. No audio. 0 frames opens a window as usual.
+    struct Headless
+    {
+      uint32 frames;
+      TimeMgr::Time step;
+
+      // Frames written to <_d_headless_dump_prefix><frame>.png.
+      uint32 dumps[_d_headless_max_dumps];
+      uint32 dumpCount;
+    };
+
+    const Headless HEADLESS;
+
+    struct Startup
+    {
+      // Decode on the main thread after the video mode is set, without a pool, for comparison.
+      bool serial;
+
+      // --bench-startup: quit once the first frame is shown.
+      bool exitAfterFirstFrame;
+    };
+
+    const Startup STARTUP;
+
+    App(uint32 screenWidth, uint32 screenHeight, uint32 soundVolume, char *windowCaption, RendererType rendererType, uint32 rendererThreads,
+      ScaleMode scaleMode, uint32 textureBudget, const Headless &headless, const Startup &startup)
+      : SCREEN_WIDTH(screenWidth), SCREEN_HEIGHT(screenHeight), VIEW_WIDTH(_d_app_view_width), VIEW_HEIGHT(_d_app_view_height),
+        SOUND_VOLUME(soundVolume), WINDOW_CAPTION(windowCaption),
+        RENDERER(headless.frames ? RendererCpu : rendererType), RENDERER_THREADS(rendererThreads), SCALE(scaleMode),
+        TEXTURE_BUDGET(textureBudget), HEADLESS(headless), STARTUP(startup)
+    {
+      renderer = null;
+      textures = null;
+
+      assetScale = SCALE == ScaleAssets ? GlRenderer::GetViewScale(SCREEN_WIDTH, SCREEN_HEIGHT, VIEW_WIDTH, VIEW_HEIGHT) : 1.0;
+
+      nowPlayingTexture = null;
+      
+      nightCityTexture = null;
+      nightCityLights1Texture = null;
+
+      airplaneTexture = null;
+      airplaneLightsRedTexture = null;
+      airplaneLightsGreenTexture = null;
+      airplaneLightsWhiteTexture = null;
+      airplaneLightsTexture = null;
+
+      airplaneLightsProgram = null;
+
+      nowPlaying = null;
+      
+      nightCity = null;
+      nightCityLights1 = null;
+
+      airplane = null;
+
+      damage = null;
+
+      #if _d_enable_overdraw_stats
+        quadFill = 0;
+        meshFill = 0;
+      #endif
+
+      scheduler = null;
+
+      blues = null;
+
+      headlessFrame = 0;
+      headlessPixels = null;
+
+      pack = null;
+      manifest = null;
+
+      timeline = null;
+
+      streamer = null;
+
+      imageCache = null;
+      for(uint32 i = 0; i < LoadCount; i++)
+      {
+        images[i] = null;
+
+        loads[i].encoded = null;
+        loads[i].size = 0;
+        loads[i].key = 0;
+        loads[i].failed = false;
+      }
+
+      initStart = 0;
+
+      profiler = null;
+      gpuTimer = null;
+    }
+
+    void Init()
+    {
+      initStart = TimeMgr::GetPerfMicros();
+
+      //
+      if(HEADLESS.frames)
+      {
+        SDL_putenv((char *)"SDL_VIDEODRIVER=dummy");
+        TimeMgr::SetClock(&headlessClock);
+      }
+
+      //
+      if(SDL_Init(SDL_INIT_VIDEO | (HEADLESS.frames ? 0 : SDL_INIT_AUDIO) | SDL_INIT_TIMER) < 0)
+        _d_log_fatal("Failed to initialize SDL: " << SDL_GetError());
+
+      //
+      atexit(SDL_Quit);
+
+      //
+      SDL_WM_SetCaption(WINDOW_CAPTION, WINDOW_CAPTION);
+
+      //
+      if(!HEADLESS.frames && Mix_OpenAudio(22050, AUDIO_S16SYS, 2, 4096) < 0)
+        _d_log_fatal("Failed to initialize audio: " << SDL_GetError());
+
+      //
+      #if _d_enable_asset_pack
+        #if _d_asset_pack_embedded
+          pack = new AssetPack(AssetPackData, (uint32)(AssetPackDataEnd - AssetPackData));
+        #else
+          pack = AssetPack::Map(_d_asset_pack_file);
+        #endif
+      #else
+        // Only for the optimizer's pages, the rest comes from resources.
+        pack = AssetPack::Map(_d_asset_pack_file, false);
+      #endif
+
+      // Pages packed offline replace decoding, see AssetManifest.
+      SDL_RWops *manifestRw = pack ? pack->Open(_d_asset_manifest_name) : null;
+      if(manifestRw)
+      {
+        manifest = AssetManifest::Read(manifestRw);
+        SDL_FreeRW(manifestRw);
+
+        if(!manifest)
+          _d_log_warn("Ignoring " << _d_asset_manifest_name << ", not a manifest of this version.");
+      }
+
+      //
+      SDL_RWops *timelineRw = pack ? pack->Open(_d_timeline_name) : null;
+      if(!timelineRw)
+        timelineRw = SDL_RWFromFile(_d_timeline_name, "rb");
+
+      if(timelineRw)
+      {
+        timeline = Timeline::Read(timelineRw);
+        SDL_RWclose(timelineRw);
+
+        if(!timeline)
+          _d_log_warn("Ignoring " << _d_timeline_name << ".");
+      }
+
+      if(!timeline)
+        timeline = MakeDefaultTimeline();
+
+      // Images decode on the pool while the music loads and the video mode and the GL context are
+      // set up. Everything SDL does stays on this thread, the pool only gets PNG decoding into
+      // surfaces made here. Cached surfaces point into mapped files, so the cache outlives every
+      // use of them.
+      imageCache = new ImageCache(_d_image_cache_dir);
+
+      if(!manifest)
+        for(uint32 i = 0; i < LoadCount; i++)
+          PrepareLoad(i);
+
+      WorkStealingPool *loader = null;
+      if(!STARTUP.serial)
+      {
+        loader = new WorkStealingPool(CpuFeatures::GetCoreCount());
+        loader->Start(*this, LoadCount);
+      }
+
+      if(!HEADLESS.frames)
+        LoadMusic();
+
+      //
+      if(RENDERER == RendererCpu)
+        renderer = new CpuRenderer(SCREEN_WIDTH, SCREEN_HEIGHT, RENDERER_THREADS);
+      else
+        renderer = new GlRenderer(SCREEN_WIDTH, SCREEN_HEIGHT, VIEW_WIDTH, VIEW_HEIGHT, SCALE == ScaleTarget);
+
+      textures = new TextureManager(*renderer, TEXTURE_BUDGET);
+
+      {
+        const uint64 waitStart = TimeMgr::GetPerfMicros();
+
+        if(loader)
+        {
+          loader->Wait();
+          delete loader;
+        }
+        else
+          for(uint32 i = 0; i < LoadCount; i++)
+            Execute(i);
+
+        _d_log_info("Startup: video ready after " << (float64)(waitStart - initStart) / 1000.0
+          << " ms, waited " << (float64)(TimeMgr::GetPerfMicros() - waitStart) / 1000.0 << " ms for assets");
+      }
+
+      for(uint32 i = 0; i < LoadCount; i++)
+      {
+        if(loads[i].failed)
+          _d_log_fatal(_d_file_line << ": failed to decode asset " << i);
+
+        delete[] loads[i].encoded;
+        loads[i].encoded = null;
+      }
+
+      // Only uploads from here on.
+      const GlCaps *caps = renderer->GetGlCaps();
+
+      // The loop starts with only the background resident, the rest streams in.
+      #if _d_enable_texture_streaming
+        streamer = new TextureStreamer(*renderer);
+      #endif
+
+      if(manifest)
+        UploadOptimized(caps);
+      else
+        UploadDecoded(caps);
+
+      LogTextureMemory();
+
+      for(uint32 i = 0; i < LoadCount; i++)
+        images[i] = null;
+
+      delete imageCache;
+      imageCache = null;
+
+      //
+      if(airplaneLightsTexture)
+      {
+        airplaneLightsProgram = new FragmentProgram(*caps, GetLightsProgramSource(airplaneLightsTexture->page.TARGET));
+        if(!airplaneLightsProgram->IsValid())
+        {
+          delete airplaneLightsProgram;
+          airplaneLightsProgram = null;
+        }
+      }
+
+      //
+      nowPlaying = new NightCityEntity(Vector2d(_d_app_np_x, _d_app_np_y), *nowPlayingTexture);
+
+      for(uint32 p = 0; p < Timeline::PropertyCount; p++)
+        nowPlayingTracks[p] = timeline->FindTrack("np", (Timeline::Property)p);
+
+      nightCity = new NightCityEntity(Vector2d(), *nightCityTexture);
+      nightCityLights1 = new NightCityEntity(Vector2d(), *nightCityLights1Texture, Fade(_d_app_nc_lights_1_fade));
+
+      airplane = new AirplaneEntity(
+        Line2d::Make(
+          // Reversed.
+          Vector2d(_d_app_airplane_landing_to_x, _d_app_airplane_landing_to_y),
+          Vector2d(_d_app_airplane_landing_from_x, _d_app_airplane_landing_from_y)),
+        *airplaneTexture,
+        *airplaneLightsRedTexture, *airplaneLightsGreenTexture, *airplaneLightsWhiteTexture,
+        Fade(_d_app_airplane_lights_fade, _d_app_airplane_lights_sleep));
+
+      if(airplaneLightsProgram)
+        airplane->lightsTexture = airplaneLightsTexture;
+
+      //
+      #if _d_enable_profiler
+        profiler = new Profiler();
+
+        if(caps && caps->timerQuery)
+          gpuTimer = new GpuTimer(*caps);
+      #endif
+
+      //
+      damage = new DamageTracker(Rect(0, 0, VIEW_WIDTH, VIEW_HEIGHT), renderer->GetBufferAge());
+
+      scheduler = new FrameScheduler(_d_app_max_fps);
+    }
+
+    void Run()
+    {
+      bool firstFrame = true;
+
+      //
+      if(blues && Mix_PlayMusic(blues, -1) == -1)
+        _d_log_fatal("Mix_PlayMusic(): " << SDL_GetError());
+
+      // Wall clock, for headless throughput.
+      const uint32 startTicks = SDL_GetTicks();
+
+      //
+      TimeMgr::Time prevTime = TimeMgr::GetTicks();
+
+      FixedStep simulation(_d_app_sim_hz, _d_app_sim_max_steps, TimeMgr::ToNanos(prevTime));
+
+      #if _d_enable_scheduler_stats
+        TimeMgr::Time simulationStatsTime = prevTime;
+      #endif
+
+      #if _d_enable_batch_stats
+        uint32 drawCalls = 0;
+      #endif
+
+      #if _d_enable_damage_stats
+        uint32 frames = 0;
+        uint64 filled = 0;
+        TimeMgr::Time statsTime = prevTime;
+      #endif
+
+      #if _d_enable_overdraw_stats
+        uint32 overdrawFrames = 0;
+        TimeMgr::Time overdrawTime = prevTime;
+      #endif
+
+      #if _d_enable_texture_stats
+        TimeMgr::Time textureStatsTime = prevTime;
+      #endif
+
+      // The first frame is drawn right away.
+      TimeMgr::Time deadline = prevTime;
 
       forever
       {
-        SDL_Event e; 
-        while(SDL_PollEvent(&e))
+        #if _d_enable_profiler
+          if(Profiler::TakeReportRequest())
+            profiler->Report();
+        #endif
+
+        {
+          _d_profile(PhaseWait);
+
+          if(HEADLESS.frames)
+          {
+            if(headlessFrame == HEADLESS.frames)
+            {
+              const uint32 elapsed = SDL_GetTicks() - startTicks;
+
+              _d_log_info("Headless: " << HEADLESS.frames << " frames in " << elapsed << " ms, "
+                << (float64)HEADLESS.frames * 1000.0 / (float64)(elapsed ? elapsed : 1) << " frames/s");
+
+              return;
+            }
+
+            if(headlessFrame)
+              headlessClock.Advance(TimeMgr::ToNanos(HEADLESS.step));
+          }
+          elif(!scheduler->Wait(deadline))
+            return;
+        }
+
+        _d_profile(PhaseFrame);
+
+        if(scheduler->WasExposed())
+          damage->Invalidate();
+
+        //
+        //static TimeMgr::Time prevTime = TimeMgr::GetTicks();
+        const TimeMgr::Nanos currentNanos = TimeMgr::GetNanos();
+        const TimeMgr::Time currentTime = TimeMgr::ToMillis(currentNanos);
+
+        // Airplane position, in fixed steps. The frame shows it between the last two.
+        {
+          _d_profile(PhaseUpdate);
+
+          const uint32 steps = simulation.Advance(currentNanos);
+          for(uint32 i = 0; i < steps; i++)
+            airplane->Step(simulation.GetStepMillis());
+        }
+
+        // The same at any frame rate, short of dropped stalls.
+        #if _d_enable_scheduler_stats
+          if(currentTime - simulationStatsTime >= _d_app_stats_interval)
+          {
+            _d_log_info("Simulation: " << (float64)simulation.TakeSteps() * 1000.0 / (float64)(currentTime - simulationStatsTime)
+              << " steps/s at " << _d_app_sim_hz << " Hz");
+
+            simulationStatsTime = currentTime;
+          }
+        #endif
+
+        //
+        if(streamer)
+        {
+          _d_profile(PhaseStream);
+
+          streamer->Update(_d_texture_streaming_budget);
+          if(streamer->IsDone())
+          {
+            delete streamer;
+            streamer = null;
+          }
+        }
+
+        float64 nightCityFade;
+        float64 airplaneLightsfade;
+        bool npVisible;
+        float64 npColor[4];
+        GLdouble npX;
+        GLdouble npY;
+        {
+          _d_profile(PhaseFade);
+
+          nightCityFade = nightCityLights1->fade.Calc(currentTime);
+          airplaneLightsfade = airplane->fade.Calc(currentTime);
+
+          const float64 npAlpha = GetUnit(timeline->Evaluate(nowPlayingTracks[Timeline::Alpha], currentTime));
+          npVisible = npAlpha > 0;
+
+          // Premultiplied.
+          npColor[0] = GetUnit(timeline->Evaluate(nowPlayingTracks[Timeline::Red], currentTime, 1)) * npAlpha;
+          npColor[1] = GetUnit(timeline->Evaluate(nowPlayingTracks[Timeline::Green], currentTime, 1)) * npAlpha;
+          npColor[2] = GetUnit(timeline->Evaluate(nowPlayingTracks[Timeline::Blue], currentTime, 1)) * npAlpha;
+          npColor[3] = npAlpha;
+
+          npX = timeline->Evaluate(nowPlayingTracks[Timeline::X], currentTime, nowPlaying->pos.GetX());
+          npY = timeline->Evaluate(nowPlayingTracks[Timeline::Y], currentTime, nowPlaying->pos.GetY());
+        }
+
+        // Released pages are reloaded here, before anything is drawn. Only what is drawn this frame
+        // is used, so hidden textures can be released. The city lights' tint is opaque, they are
+        // always drawn.
+        const bool airplaneLightsVisible = airplaneLightsfade > 0;
+
+        textures->BeginFrame();
+
+        textures->Use(nightCity->texture);
+        const bool nightCityLights1Resident = textures->Use(nightCityLights1->texture);
+        const bool airplaneResident = airplane->Use(*textures, airplaneLightsVisible);
+        const bool nowPlayingResident = npVisible && textures->Use(nowPlaying->texture);
+
+        textures->Trim();
+
+        //
+        const Vector2d airplanePosition = airplane->GetPosition(simulation.GetAlpha(currentNanos));
+        const GLdouble airplaneX = airplanePosition.GetX();
+        const GLdouble airplaneY = airplanePosition.GetY();
+
+        {
+          _d_profile(PhaseDamage);
+
+          // Next time anything on screen can change.
+          {
+            deadline = nightCityLights1->fade.GetNextChange(currentTime);
+            deadline = FrameScheduler::Min(deadline, airplane->fade.GetNextChange(currentTime));
+
+            // One pixel of movement, or the end of the path.
+            const GLdouble pixelMillis = 1.0 / _d_app_airplane_landing_speed;
+            const GLdouble pathMillis = airplane->path.GetLength() / _d_app_airplane_landing_speed;
+            deadline = FrameScheduler::Min(deadline,
+              currentTime + (TimeMgr::Time)::ceil(pathMillis < pixelMillis ? pathMillis : pixelMillis));
+
+            for(uint32 p = 0; p < Timeline::PropertyCount; p++)
+              deadline = FrameScheduler::Min(deadline, timeline->GetNextChange(nowPlayingTracks[p], currentTime));
+
+            // Keep streaming on the next frame.
+            if(streamer)
+              deadline = currentTime;
+          }
+
+          //
+          damage->Update(DamageNightCity,
+            nightCity->texture.GetVisibleBounds(nightCity->pos.GetX(), nightCity->pos.GetY()), 0);
+          if(nightCityLights1Resident)
+            damage->Update(DamageNightCityLights1,
+              nightCityLights1->texture.GetVisibleBounds(nightCityLights1->pos.GetX(), nightCityLights1->pos.GetY()),
+              SpriteBatch::PackColor(nightCityFade, 0.055, 0.055, 1));
+          else
+            damage->Hide(DamageNightCityLights1);
+
+          if(airplaneResident)
+          {
+            Rect airplaneBounds = airplane->airplaneTexture.GetVisibleBounds(airplaneX, airplaneY);
+            airplaneBounds.Union(airplane->lightsRedTexture.GetVisibleBounds(airplaneX, airplaneY));
+            airplaneBounds.Union(airplane->lightsGreenTexture.GetVisibleBounds(airplaneX, airplaneY));
+            airplaneBounds.Union(airplane->lightsWhiteTexture.GetVisibleBounds(airplaneX, airplaneY));
+
+            damage->Update(DamageAirplane, airplaneBounds,
+              SpriteBatch::PackColor(airplaneLightsfade, airplaneLightsfade, airplaneLightsfade, airplaneLightsfade));
+          }
+          else
+          {
+            damage->Hide(DamageAirplane);
+          }
+
+          if(npVisible && nowPlayingResident)
+            damage->Update(DamageNowPlaying,
+              nowPlaying->texture.GetVisibleBounds(npX, npY), SpriteBatch::PackColor(npColor[0], npColor[1], npColor[2], npColor[3]));
+          else
+            damage->Hide(DamageNowPlaying);
+        }
+
+        const DamageRegion &region = damage->GetRegion();
+        const bool fullRedraw = damage->IsFullRedraw();
+
+        #if _d_enable_damage_stats
+          frames++;
+          filled += region.GetArea();
+
+          if(currentTime - statsTime >= _d_app_stats_interval)
+          {
+            _d_log_info("Damage: " << (float64)filled * 100.0 / ((float64)frames * VIEW_WIDTH * VIEW_HEIGHT)
+              << "% of the screen repainted per frame, " << frames << " frames");
+
+            frames = 0;
+            filled = 0;
+            statsTime = currentTime;
+          }
+        #endif
+
+        // Nothing changed, the front buffer is still current.
+        if(!region.GetCount())
         {
-          if(e.type == SDL_QUIT)
-            return;
+          prevTime = currentTime;
+          EndHeadlessFrame();
+          continue;
         }
 
         //
-        //static TimeMgr::Time prevTime = TimeMgr::GetTicks();
-        const TimeMgr::Time currentTime = TimeMgr::GetTicks();
-        const TimeMgr::Time elapsedTime = currentTime - prevTime;
+        if(gpuTimer)
+          gpuTimer->Begin();
 
-        // Airplane position.
         {
-          GLdouble pathLength = airplane->path.GetLength();
-          if(pathLength <= 0)
-          {
-            airplane->path = Line2d::Make(
-              // Reversed.
-              Vector2d(_d_app_airplane_landing_to_x, _d_app_airplane_landing_to_y),
-              Vector2d(_d_app_airplane_landing_from_x, _d_app_airplane_landing_from_y));
+          _d_profile(PhaseDraw);
 
-            pathLength = airplane->path.GetLength();
+          renderer->Begin();
 
-            airplane->time = currentTime;
+          for(uint32 r = 0; r < region.GetCount(); r++)
+          {
+            const Rect clip = fullRedraw ? Rect(0, 0, VIEW_WIDTH, VIEW_HEIGHT) : region.Get(r);
+            renderer->SetClip(fullRedraw ? null : &clip);
+            renderer->Clear();
+
+            //
+            DrawSprite(nightCity->texture, nightCity->pos.GetX(), nightCity->pos.GetY(), clip);
+
+            if(nightCityLights1Resident)
+            {
+              renderer->SetColor(nightCityFade, 0.055, 0.055, 1);
+              DrawSprite(nightCityLights1->texture, nightCityLights1->pos.GetX(), nightCityLights1->pos.GetY(), clip);
+              renderer->SetColor(1, 1, 1, 1);
+            }
+
+            //
+            if(airplaneResident)
+            {
+              DrawSprite(airplane->airplaneTexture, airplaneX, airplaneY, clip);
+
+              if(airplaneLightsVisible)
+              {
+                if(airplane->lightsTexture)
+                {
+                  // The program applies the red, green and white tints itself, the color only carries the fade.
+                  renderer->SetProgram(airplaneLightsProgram);
+                  renderer->SetColor(airplaneLightsfade, airplaneLightsfade, airplaneLightsfade, airplaneLightsfade);
+                  DrawSprite(*airplane->lightsTexture, airplaneX, airplaneY, clip);
+                  renderer->SetProgram(null);
+                }
+                else
+                {
+                  // Premultiplied, the color is faded as well as the alpha, as under straight alpha.
+                  const float64 lightsColor = airplaneLightsfade * airplaneLightsfade;
+
+                  renderer->SetColor(lightsColor, 0, 0, airplaneLightsfade);
+                  DrawSprite(airplane->lightsRedTexture, airplaneX, airplaneY, clip);
+
+                  renderer->SetColor(0, lightsColor, 0, airplaneLightsfade);
+                  DrawSprite(airplane->lightsGreenTexture, airplaneX, airplaneY, clip);
+
+                  renderer->SetColor(lightsColor, lightsColor, lightsColor, airplaneLightsfade);
+                  DrawSprite(airplane->lightsWhiteTexture, airplaneX, airplaneY, clip);
+                }
+              }
+
+              renderer->SetColor(1, 1, 1, 1);
+            }
+
+            //
+            if(npVisible && nowPlayingResident)
+            {
+              renderer->SetColor(npColor[0], npColor[1], npColor[2], npColor[3]);
+              DrawSprite(nowPlaying->texture, npX, npY, clip);
+
+              renderer->SetColor(1, 1, 1, 1);
+            }
           }
 
-          uint32 elapsedTime = currentTime - airplane->time;
-          GLdouble distance = _d_app_airplane_landing_speed * elapsedTime;
-          airplane->path.AddLength(pathLength < distance ? -pathLength : -distance);
+          renderer->SetClip(null);
 
-          airplane->time = currentTime;
+          //
+          renderer->End();
         }
 
-        //
-        if(SDL_MUSTLOCK(screen))
-          SDL_LockSurface(screen);
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        //
-        nightCity->texture.DrawQuad(nightCity->pos.GetX(), nightCity->pos.GetY());
+        if(gpuTimer)
+          gpuTimer->End();
 
-        float64 nightCityFade = nightCityLights1->fade.Calc(prevTime, currentTime);
-        glColor4d(nightCityFade, 0.055, 0.055, 1);
-        nightCityLights1->texture.DrawQuad(nightCityLights1->pos.GetX(), nightCityLights1->pos.GetY());
-        glColor4d(1, 1, 1, 1);
+        #if _d_enable_batch_stats
+          if(renderer->GetDrawCalls() != drawCalls)
+          {
+            drawCalls = renderer->GetDrawCalls();
+            _d_log_info("Draw calls per frame: " << drawCalls);
+          }
+        #endif
 
-        //
-        GLdouble airplaneX = airplane->path.GetAbsDirection().GetX();
-        GLdouble airplaneY = airplane->path.GetAbsDirection().GetY();
+        #if _d_enable_overdraw_stats
+          overdrawFrames++;
 
-        airplane->airplaneTexture.DrawQuad(airplaneX, airplaneY);
+          if(currentTime - overdrawTime >= _d_app_stats_interval)
+          {
+            const float64 screen = (float64)overdrawFrames * VIEW_WIDTH * VIEW_HEIGHT;
 
-        float64 airplaneLightsfade = airplane->fade.Calc(prevTime, currentTime);
+            _d_log_info("Overdraw: sprites fill " << (float64)quadFill / screen << " screens per frame as quads, "
+              << (float64)meshFill / screen << " as meshes, " << overdrawFrames << " frames");
 
-        glColor4d(airplaneLightsfade, 0, 0, airplaneLightsfade);
-        airplane->lightsRedTexture.DrawQuad(airplaneX, airplaneY);
+            overdrawFrames = 0;
+            overdrawTime = currentTime;
+            quadFill = 0;
+            meshFill = 0;
+          }
+        #endif
 
-        glColor4d(0, airplaneLightsfade, 0, airplaneLightsfade);
-        airplane->lightsGreenTexture.DrawQuad(airplaneX, airplaneY);
+        // Without a budget nothing is ever released, the totals are logged on exit.
+        #if _d_enable_texture_stats
+          if(TEXTURE_BUDGET && currentTime - textureStatsTime >= _d_app_stats_interval)
+          {
+            const TextureManager::Stats &stats = textures->GetStats();
 
-        glColor4d(airplaneLightsfade, airplaneLightsfade, airplaneLightsfade, airplaneLightsfade);
-        airplane->lightsWhiteTexture.DrawQuad(airplaneX, airplaneY);
+            _d_log_info("Textures: " << stats.residentBytes / 1024 << " KB resident of " << TEXTURE_BUDGET / 1024
+              << " KB, peak " << stats.peakBytes / 1024 << " KB, hits " << stats.hits << ", misses " << stats.misses
+              << ", evictions " << stats.evictions);
 
-        glColor4d(1, 1, 1, 1);
+            textureStatsTime = currentTime;
+          }
+        #endif
 
         //
-        if(currentTime >= _d_app_np_appear && currentTime <= (_d_app_np_appear + (_d_app_np_fade * 2) + _d_app_np_sleep))
         {
-          float64 npFade;
-          if(currentTime >= _d_app_np_appear + _d_app_np_fade && currentTime <= _d_app_np_appear + _d_app_np_fade + _d_app_np_sleep)
-            npFade = 1;
-          else
-            npFade = nowPlaying->fade.Calc(prevTime, currentTime);
+          _d_profile(PhasePresent);
+
+          renderer->Present(region, fullRedraw);
+          damage->Present();
+        }
+
+        if(firstFrame)
+        {
+          _d_log_info("Startup: first frame after " << (float64)(TimeMgr::GetPerfMicros() - initStart) / 1000.0 << " ms");
 
-          glColor4d(1, 1, 1, npFade);
-          nowPlaying->texture.DrawQuad(_d_app_np_x, _d_app_np_y);
+          if(STARTUP.exitAfterFirstFrame)
+            return;
 
-          glColor4d(1, 1, 1, 1);
+          firstFrame = false;
         }
 
-        //
-        if(SDL_MUSTLOCK(screen))
-          SDL_FreeSurface(screen);
-        SDL_GL_SwapBuffers();
-        SDL_Delay(1);
+        #if _d_enable_profiler
+          uint64 gpuMicros;
+          while(gpuTimer && gpuTimer->Poll(gpuMicros))
+            profiler->Add(Profiler::PhaseGpu, gpuMicros);
+        #endif
 
         //
         prevTime = currentTime;
+        EndHeadlessFrame();
       }
     }
 
@@ -813,23 +7556,54 @@ class App
 
       delete airplane;
 
-      delete nowPlayingTexture;
+      delete damage;
+
+      delete scheduler;
 
-      delete nightCityTexture;
-      delete nightCityLights1Texture;
+      delete airplaneLightsProgram;
 
-      delete airplaneTexture;
-      delete airplaneLightsRedTexture;
-      delete airplaneLightsGreenTexture;
-      delete airplaneLightsWhiteTexture;
+      // Streams into the manager's pages.
+      delete streamer;
 
-      Mix_HaltMusic();
-      Mix_FreeMusic(blues);
-      Mix_CloseAudio();
+      #if _d_enable_texture_stats
+        if(textures)
+          textures->Report();
+      #endif
+
+      delete textures;
+
+      if(profiler)
+        profiler->Report();
+
+      delete profiler;
+      delete gpuTimer;
+
+      delete renderer;
+
+      delete[] headlessPixels;
+
+      if(!HEADLESS.frames)
+      {
+        Mix_HaltMusic();
+        Mix_FreeMusic(blues);
+        Mix_CloseAudio();
+      }
+
+      delete timeline;
+      delete manifest;
+
+      // The music streams from the pack, so it goes last.
+      delete pack;
+
+      // headlessClock goes with the App.
+      TimeMgr::SetClock(null);
     }
 
   private:
-    SDL_Surface *screen;
+    Renderer *renderer;
+
+    // Owns every texture below and their pages.
+    TextureManager *textures;
 
     Texture *nowPlayingTexture;
 
@@ -840,6 +7614,9 @@ class App
     Texture *airplaneLightsRedTexture;
     Texture *airplaneLightsGreenTexture;
     Texture *airplaneLightsWhiteTexture;
+    Texture *airplaneLightsTexture;
+
+    FragmentProgram *airplaneLightsProgram;
 
     NightCityEntity *nowPlaying;
 
@@ -848,82 +7625,517 @@ class App
 
     AirplaneEntity *airplane;
 
+    enum
+    {
+      DamageNightCity,
+      DamageNightCityLights1,
+      DamageAirplane,
+      DamageNowPlaying
+    };
+
+    DamageTracker *damage;
+
+    #if _d_enable_overdraw_stats
+      // Texels sprites filled since the last report, drawn as whole quads and as their meshes.
+      uint64 quadFill;
+      uint64 meshFill;
+    #endif
+
+    FrameScheduler *scheduler;
+
     Mix_Music *blues;
 
-    uint32 NextPowerOfTwo(uint32 n)
+    uint32 headlessFrame;
+    byte *headlessPixels;
+
+    // TimeMgr's clock in headless runs, advanced by HEADLESS.step per frame.
+    ManualClock headlessClock;
+
+    AssetPack *pack;
+
+    // Null unless the pack holds the optimizer's pages.
+    AssetManifest *manifest;
+
+    Timeline *timeline;
+
+    // Of the "now playing" badge, per Timeline::Property, -1 where there is none.
+    int32 nowPlayingTracks[Timeline::PropertyCount];
+
+    // Init() decodes every image on a pool, the tasks of this job.
+    enum
+    {
+      LoadNightCity,
+      LoadNowPlaying,
+      LoadNightCityLights1,
+      LoadAirplane,
+      LoadAirplaneLightsRed,
+      LoadAirplaneLightsGreen,
+      LoadAirplaneLightsWhite,
+      LoadCount
+    };
+
+    // Read by PrepareLoad() on the main thread, decoded by Execute() on the pool.
+    struct Load
     {
-      --n;
-      n |= n>>1;
-      n |= n>>2;
-      n |= n>>4;
-      n |= n>>8;
-      n |= n>>16;
-      ++n;
+      // Null when there is nothing to decode: cached, or the manifest's pages are used.
+      byte *encoded;
+      uint32 size;
 
-      return n;
+      uint64 key;
+      bool failed;
+    };
+
+    ImageCache *imageCache;
+    SDL_Surface *images[LoadCount];
+    Load loads[LoadCount];
+
+    // Texels per view unit of the loaded assets, see ScaleAssets.
+    float64 assetScale;
+
+    // Null once every page is resident.
+    TextureStreamer *streamer;
+
+    uint64 initStart;
+
+    Profiler *profiler;
+    GpuTimer *gpuTimer;
+
+    void DrawSprite(const Texture &texture, GLdouble x, GLdouble y, const Rect &clip)
+    {
+      texture.DrawMesh(*renderer, x, y);
+
+      #if _d_enable_overdraw_stats
+        quadFill += texture.GetBounds(x, y, Rect(0, 0, texture.WIDTH, texture.HEIGHT)).Intersect(clip).GetArea();
+        for(uint32 i = 0; i < texture.meshCount; i++)
+          meshFill += texture.GetBounds(x, y, texture.mesh[i]).Intersect(clip).GetArea();
+      #endif
     }
 
-    Texture* MakeTexture(SDL_Surface *surface)
+    void EndHeadlessFrame()
     {
-      GlTexture texture;
-      GLint colors;
-      GLenum textureFormat;
+      if(!HEADLESS.frames)
+        return;
 
-      GLint width = surface->w;
-      GLint height = surface->h;
+      for(uint32 i = 0; i < HEADLESS.dumpCount; i++)
+      {
+        if(HEADLESS.dumps[i] != headlessFrame)
+          continue;
 
-      //
-      GLint maxTextureSize;
-      glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
-      if(surface->w > maxTextureSize || surface->h > maxTextureSize)
-        _d_log_warn("width > maxTextureSize || height > maxTextureSize");
+        if(!headlessPixels)
+          headlessPixels = new byte[SCREEN_WIDTH * SCREEN_HEIGHT * 3];
 
-      //
-      if((width & (width - 1)))
-        width = NextPowerOfTwo(width);
+        char path[256];
+        sprintf(path, "%s%06u.png", _d_headless_dump_prefix, headlessFrame);
+
+        renderer->ReadPixels(headlessPixels);
+        if(SavePng(path, headlessPixels, SCREEN_WIDTH, SCREEN_HEIGHT))
+          _d_log_info("Headless: frame " << headlessFrame << " written to " << path);
+
+        break;
+      }
+
+      headlessFrame++;
+    }
+
+    // What each texture and page takes in its format against plain RGBA8.
+    void LogTextureMemory() const
+    {
+      const struct
+      {
+        const char *name;
+        const Texture *texture;
+      }
+      TEXTURES[] =
+      {
+        {"nc", nightCityTexture},
+        {"nc-lights1", nightCityLights1Texture},
+        {"np", nowPlayingTexture},
+        {"airplane", airplaneTexture},
+        {"airplane-lights-red", airplaneLightsRedTexture},
+        {"airplane-lights-green", airplaneLightsGreenTexture},
+        {"airplane-lights-white", airplaneLightsWhiteTexture},
+        {"airplane-lights", airplaneLightsTexture}
+      };
+
+      for(uint32 i = 0; i < sizeof(TEXTURES) / sizeof(TEXTURES[0]); i++)
+      {
+        const Texture *texture = TEXTURES[i].texture;
+        if(!texture)
+          continue;
+
+        const uint32 rgba = texture->WIDTH * texture->HEIGHT * 4;
+        const uint32 bytes = texture->GetBytes();
+
+        _d_log_info("Texture: " << TEXTURES[i].name << ", " << texture->WIDTH << "*" << texture->HEIGHT
+          << ", " << TextureFormat::GetName(texture->page.FORMAT) << ", " << bytes / 1024 << " KB"
+          << ", saved " << (rgba - bytes) / 1024 << " KB");
+      }
+
+      uint32 rgba = 0;
+      uint32 bytes = 0;
+      for(uint32 i = 0; i < textures->GetPageCount(); i++)
+      {
+        const TexturePage &page = textures->GetPage(i);
+        rgba += page.WIDTH * page.HEIGHT * 4;
+        bytes += page.GetBytes();
+      }
+
+      _d_log_info("Texture memory: " << textures->GetPageCount() << " pages, " << bytes / 1024 << " KB, RGBA8 would take "
+        << rgba / 1024 << " KB");
+
+      if(TEXTURE_BUDGET)
+        _d_log_info("Texture budget: " << TEXTURE_BUDGET / 1024 << " KB");
+    }
+
+    // Decoded images, packed into atlas pages here.
+    void UploadDecoded(const GlCaps *caps)
+    {
+      SDL_Surface *surface;
+
+
+      nightCityTexture = MakeTexture(images[LoadNightCity]);
+      if(!nightCityTexture)
+        _d_log_fatal("!nightCityTexture");
+      SDL_FreeSurface(images[LoadNightCity]);
+
+      // Everything else shares atlas pages.
+      TextureAtlas atlas(*renderer, renderer->GetMaxTextureSize() < _d_atlas_page_size ? renderer->GetMaxTextureSize() : _d_atlas_page_size,
+        assetScale);
+
+      atlas.Add(images[LoadNowPlaying], &nowPlayingTexture);
+      atlas.Add(images[LoadNightCityLights1], &nightCityLights1Texture);
+      atlas.Add(images[LoadAirplane], &airplaneTexture);
+
+      SDL_Surface *lightsRed = images[LoadAirplaneLightsRed];
+      SDL_Surface *lightsGreen = images[LoadAirplaneLightsGreen];
+      SDL_Surface *lightsWhite = images[LoadAirplaneLightsWhite];
 
-      if((height & (height - 1)))
-        height = NextPowerOfTwo(height);
+      if(caps && caps->fragmentProgram)
+      {
+        surface = PackMasks(lightsRed, lightsGreen, lightsWhite);
+        if(surface)
+          atlas.Add(surface, &airplaneLightsTexture, false);
+        else
+          _d_log_warn("Airplane light masks differ in size, drawing them in three passes.");
+      }
+
+      atlas.Add(lightsRed, &airplaneLightsRedTexture);
+      atlas.Add(lightsGreen, &airplaneLightsGreenTexture);
+      atlas.Add(lightsWhite, &airplaneLightsWhiteTexture);
+
+      atlas.Build(*textures, streamer);
+    }
+
+    // Pages and sprites as the optimizer packed them, nothing is decoded, analysed or packed here.
+    // The background's page is uploaded now, the others stream in.
+    void UploadOptimized(const GlCaps *caps)
+    {
+      // Names the optimizer was given, the files in out/.
+      const struct
+      {
+        const char *name;
+        Texture **dest;
+      }
+      SPRITES[] =
+      {
+        {"nc.png", &nightCityTexture},
+        {"np.png", &nowPlayingTexture},
+        {"nc-lights1.png", &nightCityLights1Texture},
+        {"airplane.png", &airplaneTexture},
+        {"airplane-lights-red.png", &airplaneLightsRedTexture},
+        {"airplane-lights-green.png", &airplaneLightsGreenTexture},
+        {"airplane-lights-white.png", &airplaneLightsWhiteTexture}
+      };
+
+      const AssetManifest::Header &header = manifest->GetHeader();
+      if(header.pageCount > _d_app_max_texture_pages - textures->GetPageCount())
+        _d_log_fatal("Too many texture pages, max " << _d_app_max_texture_pages);
+
+      if(assetScale != 1.0)
+        _d_log_warn("Optimized assets are drawn as packed, not resampled.");
+
+      const AssetManifest::Sprite *background = manifest->FindSprite(SPRITES[0].name);
+      if(!background)
+        _d_log_fatal(_d_asset_manifest_name << ": no " << SPRITES[0].name);
 
       //
-      colors = surface->format->BytesPerPixel;
-      if(colors == 4)
+      SDL_Surface *surfaces[_d_app_max_texture_pages];
+      TexturePage *optimized[_d_app_max_texture_pages];
+
+      for(uint32 p = 0; p < header.pageCount; p++)
       {
-        if(surface->format->Rmask == 0x000000ff)
-          textureFormat = GL_RGBA;
+        const AssetManifest::Page &page = manifest->GetPage(p);
+
+        SDL_RWops *rw = pack->Open(page.name);
+        surfaces[p] = rw ? manifest->LoadPage(p, rw) : null;
+        if(rw)
+          SDL_FreeRW(rw);
+
+        if(!surfaces[p])
+          _d_log_fatal(_d_asset_manifest_name << ": failed to load " << page.name);
+
+        const TextureFormat::Type format = (TextureFormat::Type)page.format;
+        if(streamer && p != background->page)
+          optimized[p] = renderer->CreateEmptyPage(page.width, page.height, format);
         else
-          textureFormat = GL_BGRA;
+          optimized[p] = renderer->CreatePage(surfaces[p], format);
+
+        // Released pages come back from the pack rather than from a copy.
+        textures->AddPage(optimized[p], TEXTURE_BUDGET ? new ManifestPageSource(*manifest, *pack, p) : (PageSource *)null);
       }
-      elif(colors == 3)
+
+      for(uint32 i = 0; i < sizeof(SPRITES) / sizeof(SPRITES[0]); i++)
       {
-        if(surface->format->Rmask == 0x000000ff)
-          textureFormat = GL_RGB;
+        const AssetManifest::Sprite *sprite = manifest->FindSprite(SPRITES[i].name);
+        if(!sprite)
+          _d_log_fatal(_d_asset_manifest_name << ": no " << SPRITES[i].name);
+
+        Texture *texture = textures->AddTexture(new Texture(*optimized[sprite->page], sprite->x, sprite->y, sprite->width, sprite->height));
+        texture->trimX = sprite->trimX;
+        texture->trimY = sprite->trimY;
+        texture->visible = Rect(sprite->trimX, sprite->trimY, sprite->width, sprite->height);
+        texture->BuildMesh(surfaces[sprite->page], sprite->x, sprite->y);
+
+        *SPRITES[i].dest = texture;
+      }
+
+      // The masks are trimmed alike, so they still pack into one texture.
+      if(caps && caps->fragmentProgram)
+      {
+        const Texture *masks[3] = {airplaneLightsRedTexture, airplaneLightsGreenTexture, airplaneLightsWhiteTexture};
+        SDL_Surface *copies[3];
+
+        for(uint32 i = 0; i < 3; i++)
+          copies[i] = CopyTexels(surfaces[GetPageIndex(optimized, masks[i]->page)], *masks[i]);
+
+        SDL_Surface *surface = masks[0]->trimX == masks[1]->trimX && masks[0]->trimX == masks[2]->trimX
+          && masks[0]->trimY == masks[1]->trimY && masks[0]->trimY == masks[2]->trimY
+          ? PackMasks(copies[0], copies[1], copies[2]) : null;
+
+        for(uint32 i = 0; i < 3; i++)
+          SDL_FreeSurface(copies[i]);
+
+        if(surface)
+        {
+          TextureAtlas atlas(*renderer, renderer->GetMaxTextureSize() < _d_atlas_page_size ? renderer->GetMaxTextureSize() : _d_atlas_page_size);
+          atlas.Add(surface, &airplaneLightsTexture, false);
+          atlas.Build(*textures, streamer);
+
+          airplaneLightsTexture->trimX = masks[0]->trimX;
+          airplaneLightsTexture->trimY = masks[0]->trimY;
+          airplaneLightsTexture->visible.x += masks[0]->trimX;
+          airplaneLightsTexture->visible.y += masks[0]->trimY;
+        }
         else
-          textureFormat = GL_BGR;
+        {
+          _d_log_warn("Airplane light masks differ in size, drawing them in three passes.");
+        }
+      }
+
+      for(uint32 p = 0; p < header.pageCount; p++)
+        if(streamer && p != background->page)
+          streamer->Add(*optimized[p], surfaces[p]);
+        else
+          SDL_FreeSurface(surfaces[p]);
+    }
+
+    static uint32 GetPageIndex(TexturePage **pages, const TexturePage &page)
+    {
+      uint32 i = 0;
+      while(pages[i] != &page)
+        i++;
+
+      return i;
+    }
+
+    // Without a timeline file: the badge fades in at _d_app_np_appear, holds and fades out.
+    static Timeline* MakeDefaultTimeline()
+    {
+      char text[256];
+      sprintf(text, "np alpha %u 0 %u 1 %u 1 %u 0\n", _d_app_np_appear, _d_app_np_appear + _d_app_np_fade,
+        _d_app_np_appear + _d_app_np_fade + _d_app_np_sleep, _d_app_np_appear + _d_app_np_fade * 2 + _d_app_np_sleep);
+
+      return Timeline::Parse(text);
+    }
+
+    // Clamped to [0, 1].
+    static float64 GetUnit(float64 value)
+    {
+      return value < 0 ? 0 : (value > 1 ? 1 : value);
+    }
+
+    // A texture's rectangle of its page's surface.
+    static SDL_Surface* CopyTexels(const SDL_Surface *page, const Texture &texture)
+    {
+      SDL_Surface *copy = CreateRgbaSurface(texture.WIDTH, texture.HEIGHT);
+
+      for(GLint y = 0; y < texture.HEIGHT; y++)
+        memcpy((byte *)copy->pixels + y * copy->pitch,
+          (const byte *)page->pixels + (texture.Y + y) * page->pitch + texture.X * 4, texture.WIDTH * 4);
+
+      return copy;
+    }
+
+    Texture* MakeTexture(SDL_Surface *surface)
+    {
+      // Analysed straight, stored premultiplied.
+      const TextureFormat::Type format = TextureFormat::Choose(surface);
+      SDL_Surface *rgba = ConvertToRgba(surface);
+      PremultiplyAlpha(rgba);
+
+      TexturePage *page = renderer->CreatePage(rgba, format);
+      textures->AddPage(page, rgba);
+
+      Texture *texture = textures->AddTexture(new Texture(*page, 0, 0, surface->w, surface->h));
+      texture->scale = assetScale;
+      texture->BuildMesh(rgba, 0, 0);
+      SDL_FreeSurface(rgba);
+
+      return texture;
+    }
+
+    // Draws the red, green and white lights in one pass. Each mask channel is composited "over"
+    // the previous one exactly as the three premultiplied passes would, the fade in the alpha. The
+    // sum is scaled by the fade once more, as the straight alpha passes faded the lights' color twice.
+    static const char* GetLightsProgramSource(GLenum target)
+    {
+      #define _d_lights_program(__target) \
+        "!!ARBfp1.0\n" \
+        "PARAM one = {1.0, 1.0, 1.0, 1.0};\n" \
+        "PARAM red = {1.0, 0.0, 0.0, 0.0};\n" \
+        "PARAM green = {0.0, 1.0, 0.0, 0.0};\n" \
+        "TEMP mask, alpha, inv, acc, a;\n" \
+        "TEX mask, fragment.texcoord[0], texture[0], " __target ";\n" \
+        "MUL alpha, mask, fragment.color.a;\n" \
+        "SUB inv, one, alpha;\n" \
+        "MUL acc, red, alpha.x;\n" \
+        "MUL acc, acc, inv.y;\n" \
+        "MAD acc, green, alpha.y, acc;\n" \
+        "MUL acc, acc, inv.z;\n" \
+        "ADD acc, acc, alpha.z;\n" \
+        "MUL acc, acc, fragment.color.a;\n" \
+        "MUL a.x, inv.x, inv.y;\n" \
+        "MUL a.x, a.x, inv.z;\n" \
+        "MOV result.color.xyz, acc;\n" \
+        "SUB result.color.w, one.x, a.x;\n" \
+        "END\n"
+
+      static const char *program2d = _d_lights_program("2D");
+      static const char *programRect = _d_lights_program("RECT");
+
+      #undef _d_lights_program
+
+      return target == GL_TEXTURE_RECTANGLE_ARB ? programRect : program2d;
+    }
+
+    // Main thread. Reads an image and maps it from the cache, or makes the surface Execute() decodes
+    // into.
+    void PrepareLoad(uint32 task)
+    {
+      static const ResourceId RESOURCES[LoadCount] =
+      {
+        _d_app_res_nc, _d_app_res_np, _d_app_res_nc_lights_1, _d_app_res_airplane,
+        _d_app_res_airplane_lights_red, _d_app_res_airplane_lights_green, _d_app_res_airplane_lights_white
+      };
+
+      SDL_RWops *rw = LoadResource(RESOURCES[task]);
+      if(!rw)
+        _d_log_fatal(_d_file_line << ": " << SDL_GetError());
+
+      Load &load = loads[task];
+
+      const int size = SDL_RWseek(rw, 0, RW_SEEK_END);
+      SDL_RWseek(rw, 0, RW_SEEK_SET);
+      if(size <= 0)
+        _d_log_fatal(_d_file_line << ": empty asset " << task);
+
+      load.size = (uint32)size;
+      load.encoded = new byte[load.size];
+      if(SDL_RWread(rw, load.encoded, 1, size) != size)
+        _d_log_fatal(_d_file_line << ": " << SDL_GetError());
+
+      SDL_FreeRW(rw);
+
+      //
+      load.key = ImageCache::GetKey(load.encoded, load.size, assetScale);
+
+      images[task] = imageCache->Find(load.key);
+      if(images[task])
+      {
+        delete[] load.encoded;
+        load.encoded = null;
+
+        return;
+      }
+
+      GLint width;
+      GLint height;
+      if(!GetPngSize(load.encoded, load.size, width, height))
+        _d_log_fatal(_d_file_line << ": asset " << task << " is not a PNG");
+
+      if(assetScale != 1.0)
+      {
+        width = (GLint)(width * assetScale + 0.5);
+        height = (GLint)(height * assetScale + 0.5);
       }
+
+      images[task] = CreateRgbaSurface(width > 0 ? width : 1, height > 0 ? height : 1);
+    }
+
+    // On the pool, touches only the task's Load and the pixels of its surface.
+    void Execute(uint32 task)
+    {
+      Load &load = loads[task];
+      if(!load.encoded)
+        return;
+
+      SDL_Surface *rgba = images[task];
+
+      GLint width;
+      GLint height;
+      GetPngSize(load.encoded, load.size, width, height);
+
+      if(assetScale == 1.0)
+        load.failed = !DecodePng(load.encoded, load.size, (byte *)rgba->pixels, width, height, rgba->pitch);
       else
       {
-        _d_log_warn(_d_file_line);
+        byte *decoded = new byte[width * height * 4];
+
+        load.failed = !DecodePng(load.encoded, load.size, decoded, width, height, width * 4);
+        if(!load.failed)
+          ScaleRgba(decoded, width, height, width * 4, (byte *)rgba->pixels, rgba->w, rgba->h, rgba->pitch);
+
+        delete[] decoded;
       }
 
-      _d_log_info("Img: " << width << "*" << height << ", RGBA: " << (textureFormat == GL_RGBA));
- 
-      //
-      glGenTextures(1, &texture);
-      glBindTexture(GL_TEXTURE_2D, texture);
- 
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST/*GL_LINEAR*/);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST/*GL_LINEAR*/);
- 
-      glTexImage2D(GL_TEXTURE_2D, 0, colors, width, height, 0, textureFormat, GL_UNSIGNED_BYTE, null);
-      glTexSubImage2D(GL_TEXTURE_2D, 0,
-        0, 0, surface->w, surface->h,
-        textureFormat, GL_UNSIGNED_BYTE, surface->pixels);
+      if(!load.failed)
+        imageCache->Store(load.key, rgba);
+    }
+
+    // Main thread, SDL_mixer is not thread-safe.
+    void LoadMusic()
+    {
+      SDL_RWops *rw = LoadResource(_d_app_res_blues);
+      if(!rw)
+        _d_log_fatal(_d_file_line << ": " << SDL_GetError());
 
-      return new Texture(texture, surface->w, surface->h, (double)surface->w / (double)width, (double)surface->h / (double)height);
+      //blues = Mix_LoadMUS("blues.mp3");
+      blues = Mix_LoadMUS_RW(rw);
+      if(!blues)
+        _d_log_fatal(_d_file_line << ": " << SDL_GetError());
+      //SDL_FreeRW(rw); // Commented out. Required by streamer.
     }
 
-    #if _d_os_win
+    #if _d_enable_asset_pack
+      typedef const char *ResourceId;
+
+      SDL_RWops* LoadResource(const char *name)
+      {
+        return pack->Open(name);
+      }
+    #elif _d_os_win
+      typedef int ResourceId;
+
       SDL_RWops* LoadResource(int resourceId)
       {
         HRSRC resRef = FindResourceA(null, MAKEINTRESOURCEA(resourceId), "FOO");
@@ -965,6 +8177,7 @@ void SignalHandlerSeg(int s)
   _d_log_fatal("Caught " << _d_funcname);
 }
 
+#if !_d_optimizer
 int main(int argc, char **argv)
 {
   //
@@ -972,20 +8185,180 @@ int main(int argc, char **argv)
   signal(SIGILL, SignalHandlerIll);
   signal(SIGSEGV, SignalHandlerSeg);
 
+  #if _d_enable_profiler
+    #if _d_os_win
+      signal(SIGBREAK, Profiler::OnSignal);
+    #else
+      signal(SIGUSR1, Profiler::OnSignal);
+    #endif
+  #endif
+
   // Defaults.
   uint32 screenWidth = _d_app_default_screen_width;
   uint32 screenHeight = _d_app_default_screen_height;
   uint32 soundVolume = _d_app_default_sound_volume;
   char *windowCaption = _d_app_window_caption;
+  App::RendererType renderer = _d_app_default_renderer_cpu ? App::RendererCpu : App::RendererGl;
+  uint32 rendererThreads = _d_cpu_renderer_threads;
+  App::ScaleMode scaleMode = (App::ScaleMode)_d_app_default_scale_mode;
+  uint32 textureBudget = _d_texture_budget_kb * 1024;
+  bool benchRaster = false;
+  bool benchScale = false;
+  bool soakFade = false;
+  bool benchTimeline = false;
+  bool benchFades = false;
+  bool checkTextureBudget = false;
+  const char *makePack = null;
+
+  App::Headless headless;
+  headless.frames = 0;
+  headless.step = _d_headless_step;
+  headless.dumpCount = 0;
+
+  App::Startup startup;
+  startup.serial = false;
+  startup.exitAfterFirstFrame = false;
+
+  //
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--renderer=gl"))
+      renderer = App::RendererGl;
+    elif(!strcmp(argv[i], "--renderer=cpu"))
+      renderer = App::RendererCpu;
+    elif(!strncmp(argv[i], "--threads=", 10))
+      rendererThreads = (uint32)atoi(argv[i] + 10);
+    elif(!strncmp(argv[i], "--size=", 7))
+    {
+      if(sscanf(argv[i] + 7, "%ux%u", &screenWidth, &screenHeight) != 2 || !screenWidth || !screenHeight)
+        _d_log_fatal("Bad --size, expected WIDTHxHEIGHT: " << argv[i]);
+    }
+    elif(!strcmp(argv[i], "--scale=native"))
+      scaleMode = App::ScaleNative;
+    elif(!strcmp(argv[i], "--scale=target"))
+      scaleMode = App::ScaleTarget;
+    elif(!strcmp(argv[i], "--scale=assets"))
+      scaleMode = App::ScaleAssets;
+    elif(!strncmp(argv[i], "--texture-budget=", 17))
+      textureBudget = (uint32)atoi(argv[i] + 17) * 1024;
+    elif(!strcmp(argv[i], "--bench-raster"))
+      benchRaster = true;
+    elif(!strcmp(argv[i], "--bench-scale"))
+      benchScale = true;
+    elif(!strcmp(argv[i], "--soak-fade"))
+      soakFade = true;
+    elif(!strcmp(argv[i], "--bench-timeline"))
+      benchTimeline = true;
+    elif(!strcmp(argv[i], "--bench-fades"))
+      benchFades = true;
+    elif(!strcmp(argv[i], "--check-texture-budget"))
+      checkTextureBudget = true;
+    elif(!strcmp(argv[i], "--serial-init"))
+      startup.serial = true;
+    elif(!strcmp(argv[i], "--bench-startup"))
+      startup.exitAfterFirstFrame = true;
+    elif(!strncmp(argv[i], "--make-pack=", 12))
+      makePack = argv[i] + 12;
+    elif(!strncmp(argv[i], "--headless=", 11))
+      headless.frames = (uint32)atoi(argv[i] + 11);
+    elif(!strncmp(argv[i], "--step=", 7))
+      headless.step = (TimeMgr::Time)atoi(argv[i] + 7);
+    elif(!strncmp(argv[i], "--dump=", 7))
+    {
+      if(headless.dumpCount < _d_headless_max_dumps)
+        headless.dumps[headless.dumpCount++] = (uint32)atoi(argv[i] + 7);
+      else
+        _d_log_warn("Too many --dump frames, max " << _d_headless_max_dumps);
+    }
+    else
+      _d_log_warn("Unknown argument: " << argv[i]);
+  }
+
+  //
+  #if _d_enable_asset_pack
+    if(makePack)
+    {
+      const char *const names[] =
+      {
+        _d_app_res_np, _d_app_res_nc, _d_app_res_nc_lights_1,
+        _d_app_res_airplane, _d_app_res_airplane_lights_red, _d_app_res_airplane_lights_green, _d_app_res_airplane_lights_white,
+        _d_app_res_blues
+      };
+      const uint32 count = sizeof(names) / sizeof(names[0]);
+
+      char paths[count][256];
+      const char *files[count];
+      for(uint32 i = 0; i < count; i++)
+      {
+        sprintf(paths[i], "%s/%s", makePack, names[i]);
+        files[i] = paths[i];
+      }
+
+      return AssetPack::Write(_d_asset_pack_file, names, files, count) ? 0 : 1;
+    }
+  #endif
 
   //
-  ;
+  if(benchRaster)
+  {
+    if(SDL_Init(SDL_INIT_TIMER) < 0)
+      _d_log_fatal("Failed to initialize SDL: " << SDL_GetError());
+
+    RasterBench::Run(rendererThreads);
+    SDL_Quit();
+
+    return 0;
+  }
+
+  if(soakFade)
+    return FadeSoak::Run() ? 0 : 1;
+
+  if(benchTimeline)
+    return TimelineBench::Run() ? 0 : 1;
+
+  if(benchFades)
+    return FadeBankBench::Run() ? 0 : 1;
+
+  if(checkTextureBudget)
+  {
+    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0)
+      _d_log_fatal("Failed to initialize SDL: " << SDL_GetError());
+
+    const bool ok = TextureBudgetCheck::Run();
+    SDL_Quit();
+
+    return ok ? 0 : 1;
+  }
+
+  if(benchScale)
+  {
+    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0)
+      _d_log_fatal("Failed to initialize SDL: " << SDL_GetError());
+
+    ScaleBench::Run(screenWidth, screenHeight);
+    SDL_Quit();
+
+    return 0;
+  }
 
   //
-  App app(screenWidth, screenHeight, soundVolume, windowCaption);
+  if(headless.frames && renderer == App::RendererGl)
+    _d_log_info("Headless runs use the CPU renderer.");
+
+  // CpuRenderer draws texels 1:1.
+  if((headless.frames || renderer == App::RendererCpu)
+    && (screenWidth != _d_app_view_width || screenHeight != _d_app_view_height))
+  {
+    _d_log_warn("The CPU renderer does not scale, using " << _d_app_view_width << "*" << _d_app_view_height << ".");
+    screenWidth = _d_app_view_width;
+    screenHeight = _d_app_view_height;
+  }
+
+  App app(screenWidth, screenHeight, soundVolume, windowCaption, renderer, rendererThreads, scaleMode, textureBudget, headless, startup);
   app.Init();
   app.Run();
   app.Destroy();
 
   return 0;
 }
+#endif
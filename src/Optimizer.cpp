@@ -0,0 +1,408 @@
+// Offline asset optimizer, a build target of its own:
+//
+//   NightCityBlues-Optimizer [--straight] <pack> <files...>
+//
+// PNGs are trimmed to their visible texels, packed into atlas pages of the smallest TextureFormat
+// and stored deflated, color premultiplied unless --straight. Other files are stored as they are.
+// App::Init() loads the resulting AssetManifest instead of decoding anything.
+#define _d_optimizer 1
+#include "Main.cpp"
+
+//
+//
+//
+// Keeps the pages TextureAtlas builds instead of uploading them.
+class PageRecorder : public Renderer
+{
+  public:
+    SDL_Surface *surfaces[_d_app_max_texture_pages];
+    uint32 count;
+
+    PageRecorder()
+      : count(0)
+    {
+      ;
+    }
+
+    ~PageRecorder()
+    {
+      for(uint32 i = 0; i < count; i++)
+        SDL_FreeSurface(surfaces[i]);
+    }
+
+    const GlCaps* GetGlCaps() const
+    {
+      return null;
+    }
+
+    uint32 GetBufferAge() const
+    {
+      return 0;
+    }
+
+    // Pages are stored as packed, the runtime pads them if it has to.
+    GLint GetTextureSize(GLint n) const
+    {
+      return n;
+    }
+
+    GLint GetMaxTextureSize() const
+    {
+      return _d_atlas_page_size;
+    }
+
+    TexturePage* CreatePage(SDL_Surface *surface, TextureFormat::Type format)
+    {
+      if(count == _d_app_max_texture_pages)
+        _d_log_fatal("PageRecorder: too many pages, max " << _d_app_max_texture_pages);
+
+      // Lossy formats are left to the renderer that loads the page.
+      if(format == TextureFormat::Rgb565 || format == TextureFormat::Dxt1)
+        format = TextureFormat::Rgb8;
+
+      surfaces[count++] = ConvertToRgba(surface);
+
+      return new TexturePage(0, GL_TEXTURE_2D, surface->w, surface->h, format);
+    }
+
+    TexturePage* CreateEmptyPage(GLint /*width*/, GLint /*height*/, TextureFormat::Type /*format*/)
+    {
+      _d_log_fatal("PageRecorder: pages are not streamed");
+      return null;
+    }
+
+    void UpdatePage(TexturePage &/*page*/, const SDL_Surface * /*rgba*/, GLint /*y*/, GLint /*rows*/) {}
+    void RestorePage(TexturePage &/*page*/, const SDL_Surface * /*rgba*/) {}
+    void Begin() {}
+    void End() {}
+    void SetClip(const Rect * /*rect*/) {}
+    void Clear() {}
+    void SetColor(float64 /*r*/, float64 /*g*/, float64 /*b*/, float64 /*a*/) {}
+    void SetProgram(const FragmentProgram * /*program*/) {}
+    void Draw(const Texture &/*texture*/, GLdouble /*x*/, GLdouble /*y*/) {}
+    void Draw(const Texture &/*texture*/, GLdouble /*x*/, GLdouble /*y*/, const Rect &/*part*/) {}
+    void Present(const DamageRegion &/*region*/, bool /*fullRedraw*/) {}
+    void ReadPixels(byte * /*rgb*/) const {}
+
+    bool ReleasePage(TexturePage &/*page*/)
+    {
+      return false;
+    }
+
+    uint32 GetDrawCalls() const
+    {
+      return 0;
+    }
+};
+
+//
+//
+//
+class Optimizer
+{
+  public:
+    static bool Run(const char *path, const char *const *files, uint32 count, bool premultiply)
+    {
+      if(count > _d_atlas_max_sprites)
+      {
+        _d_log_err("Optimizer: too many files, max " << _d_atlas_max_sprites);
+        return false;
+      }
+
+      Image *images = new Image[count];
+      uint32 imageCount = 0;
+      uint32 inputBytes = 0;
+
+      for(uint32 i = 0; i < count; i++)
+        inputBytes += GetFileSize(files[i]);
+
+      //
+      bool ok = true;
+      for(uint32 i = 0; i < count && ok; i++)
+      {
+        if(!IsPng(files[i]))
+          continue;
+
+        SDL_Surface *surface = IMG_Load(files[i]);
+        if(!surface)
+        {
+          _d_log_err("Optimizer: failed to load " << files[i] << ": " << IMG_GetError());
+          ok = false;
+          break;
+        }
+
+        Image &image = images[imageCount++];
+        image.file = files[i];
+        image.rgba = ConvertToRgba(surface);
+        image.trim = TextureAtlas::GetVisibleRect(image.rgba);
+        image.texture = null;
+        SDL_FreeSurface(surface);
+      }
+
+      if(!ok)
+      {
+        Free(images, imageCount);
+        return false;
+      }
+
+      // Masks over the same source share bounds, the runtime packs them into one texture.
+      for(uint32 i = 0; i < imageCount; i++)
+        if(TextureFormat::Analyze(images[i].rgba, false) == TextureFormat::Alpha8)
+          for(uint32 j = 0; j < imageCount; j++)
+            if(j != i && images[j].rgba->w == images[i].rgba->w && images[j].rgba->h == images[i].rgba->h
+              && TextureFormat::Analyze(images[j].rgba, false) == TextureFormat::Alpha8)
+              images[i].trim.Union(images[j].trim);
+
+      //
+      PageRecorder recorder;
+      TextureManager textures(recorder, 0);
+      uint32 pageCount;
+
+      {
+        TextureAtlas atlas(recorder, _d_atlas_page_size);
+
+        for(uint32 i = 0; i < imageCount; i++)
+        {
+          Image &image = images[i];
+
+          // A blank image keeps a single transparent texel.
+          if(image.trim.IsEmpty())
+            image.trim = Rect(0, 0, 1, 1);
+
+          // EncodePage() premultiplies, unless --straight.
+          atlas.Add(Crop(image.rgba, image.trim), &image.texture, false);
+        }
+
+        pageCount = atlas.Build(textures);
+      }
+
+      //
+      AssetManifest::Header header;
+      memset(&header, 0, sizeof(header));
+      header.magic = AssetManifest::MAGIC;
+      header.version = AssetManifest::VERSION;
+      header.flags = premultiply ? AssetManifest::FLAG_PREMULTIPLIED : 0;
+      header.pageCount = pageCount;
+      header.spriteCount = imageCount;
+
+      AssetManifest::Page *pageRecords = new AssetManifest::Page[pageCount];
+      AssetManifest::Sprite *spriteRecords = new AssetManifest::Sprite[imageCount];
+
+      // The manifest, the pages and the files stored as they are.
+      const uint32 entryCount = 1 + pageCount + count - imageCount;
+      char (*names)[_d_asset_pack_name_length] = new char[entryCount][_d_asset_pack_name_length];
+      char (*paths)[256] = new char[entryCount][256];
+      uint32 entry = 0;
+
+      SetEntry(names[entry], paths[entry], path, _d_asset_manifest_name);
+      entry++;
+
+      uint32 pageBytes = 0;
+      for(uint32 p = 0; p < pageCount && ok; p++)
+      {
+        AssetManifest::Page &record = pageRecords[p];
+        memset(&record, 0, sizeof(record));
+        sprintf(record.name, "atlas%u", p);
+        const TexturePage &page = textures.GetPage(p);
+        record.width = page.WIDTH;
+        record.height = page.HEIGHT;
+        record.format = page.FORMAT;
+        record.size = record.width * record.height * AssetManifest::GetTexelBytes(page.FORMAT);
+
+        uint32 size;
+        byte *data = AssetManifest::EncodePage(recorder.surfaces[p], page.FORMAT, premultiply, size);
+
+        SetEntry(names[entry], paths[entry], path, record.name);
+        ok = WriteFile(paths[entry], data, size);
+        entry++;
+        delete[] data;
+
+        pageBytes += size;
+        _d_log_info("Optimizer: " << record.name << ", " << record.width << "*" << record.height
+          << ", " << TextureFormat::GetName(page.FORMAT) << ", " << record.size / 1024 << " KB -> " << size / 1024 << " KB");
+      }
+
+      for(uint32 i = 0; i < imageCount; i++)
+      {
+        const Image &image = images[i];
+        AssetManifest::Sprite &record = spriteRecords[i];
+        memset(&record, 0, sizeof(record));
+        strncpy(record.name, GetBaseName(image.file), _d_asset_pack_name_length - 1);
+
+        for(uint32 p = 0; p < pageCount; p++)
+          if(&textures.GetPage(p) == &image.texture->page)
+            record.page = p;
+
+        record.x = image.texture->X;
+        record.y = image.texture->Y;
+        record.width = image.texture->WIDTH;
+        record.height = image.texture->HEIGHT;
+        record.trimX = image.trim.x;
+        record.trimY = image.trim.y;
+        record.sourceWidth = image.rgba->w;
+        record.sourceHeight = image.rgba->h;
+
+        _d_log_info("Optimizer: " << record.name << ", " << record.sourceWidth << "*" << record.sourceHeight
+          << " -> " << record.width << "*" << record.height << " at " << record.trimX << "," << record.trimY
+          << ", page " << record.page);
+      }
+
+      //
+      if(ok)
+      {
+        FILE *out = fopen(paths[0], "wb");
+        ok = out
+          && fwrite(&header, sizeof(header), 1, out) == 1
+          && fwrite(pageRecords, sizeof(AssetManifest::Page), pageCount, out) == pageCount
+          && fwrite(spriteRecords, sizeof(AssetManifest::Sprite), imageCount, out) == imageCount;
+        if(out)
+          fclose(out);
+        if(!ok)
+          _d_log_err("Optimizer: failed to write " << paths[0]);
+      }
+
+      // Packed entries are read from the temporary files, the rest from where they are.
+      const char *entryNames[_d_atlas_max_sprites + _d_app_max_texture_pages + 1];
+      const char *entryFiles[_d_atlas_max_sprites + _d_app_max_texture_pages + 1];
+      const uint32 packed = entry;
+
+      for(uint32 i = 0; i < packed; i++)
+      {
+        entryNames[i] = names[i];
+        entryFiles[i] = paths[i];
+      }
+
+      for(uint32 i = 0; i < count; i++)
+        if(!IsPng(files[i]))
+        {
+          entryNames[entry] = GetBaseName(files[i]);
+          entryFiles[entry] = files[i];
+          entry++;
+        }
+
+      if(ok)
+        ok = AssetPack::Write(path, entryNames, entryFiles, entry);
+
+      for(uint32 i = 0; i < packed; i++)
+        remove(paths[i]);
+
+      if(ok)
+        _d_log_info("Optimizer: " << imageCount << " images, " << pageCount << " pages, "
+          << inputBytes / 1024 << " KB -> " << GetFileSize(path) / 1024 << " KB, pages " << pageBytes / 1024 << " KB");
+
+      //
+      delete[] pageRecords;
+      delete[] spriteRecords;
+      delete[] names;
+      delete[] paths;
+      Free(images, imageCount);
+
+      return ok;
+    }
+
+  private:
+    struct Image
+    {
+      const char *file;
+      SDL_Surface *rgba;
+      Rect trim;
+      Texture *texture;
+    };
+
+    static void Free(Image *images, uint32 count)
+    {
+      for(uint32 i = 0; i < count; i++)
+        SDL_FreeSurface(images[i].rgba);
+
+      delete[] images;
+    }
+
+    static SDL_Surface* Crop(const SDL_Surface *rgba, const Rect &rect)
+    {
+      SDL_Surface *crop = CreateRgbaSurface(rect.width, rect.height);
+
+      for(GLint y = 0; y < rect.height; y++)
+        memcpy((byte *)crop->pixels + y * crop->pitch,
+          (const byte *)rgba->pixels + (rect.y + y) * rgba->pitch + rect.x * sizeof(uint32),
+          rect.width * sizeof(uint32));
+
+      return crop;
+    }
+
+    static bool IsPng(const char *file)
+    {
+      const size_t length = strlen(file);
+      if(length < 4)
+        return false;
+
+      const char *ext = file + length - 4;
+      return ext[0] == '.' && tolower(ext[1]) == 'p' && tolower(ext[2]) == 'n' && tolower(ext[3]) == 'g';
+    }
+
+    static const char* GetBaseName(const char *file)
+    {
+      const char *name = file;
+      for(const char *c = file; *c; c++)
+        if(*c == '/' || *c == '\\')
+          name = c + 1;
+
+      return name;
+    }
+
+    // Temporary files sit next to the pack.
+    static void SetEntry(char *name, char *path, const char *pack, const char *entry)
+    {
+      memset(name, 0, _d_asset_pack_name_length);
+      strncpy(name, entry, _d_asset_pack_name_length - 1);
+      sprintf(path, "%.200s.%s", pack, name);
+    }
+
+    static uint32 GetFileSize(const char *file)
+    {
+      FILE *in = fopen(file, "rb");
+      if(!in)
+        return 0;
+
+      fseek(in, 0, SEEK_END);
+      const long size = ftell(in);
+      fclose(in);
+
+      return size > 0 ? (uint32)size : 0;
+    }
+
+    static bool WriteFile(const char *file, const byte *data, uint32 size)
+    {
+      FILE *out = fopen(file, "wb");
+      const bool ok = out && fwrite(data, 1, size, out) == size;
+      if(out)
+        fclose(out);
+
+      if(!ok)
+        _d_log_err("Optimizer: failed to write " << file);
+
+      return ok;
+    }
+};
+
+//
+//
+//
+int main(int argc, char **argv)
+{
+  bool premultiply = true;
+  int first = 1;
+
+  if(argc > first && !strcmp(argv[first], "--straight"))
+  {
+    premultiply = false;
+    first++;
+  }
+
+  if(argc - first < 2)
+  {
+    _d_log_err("Usage: NightCityBlues-Optimizer [--straight] <pack> <files...>");
+    return 1;
+  }
+
+  return Optimizer::Run(argv[first], argv + first + 1, argc - first - 1, premultiply) ? 0 : 1;
+}